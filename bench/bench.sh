@@ -0,0 +1,66 @@
+#!/bin/sh
+# Replays the standard keystroke traces against generated files with
+# "kilo -b" and prints one report line per trace.
+#
+# usage: bench/bench.sh [kilo] ; BENCH_LINES sets the size of the big file.
+# Every key is painted, unless KILO_FPS is set to cap the frame rate as an
+# interactive session does.
+
+KILO=${1:-./kilo}
+LINES=${BENCH_LINES:-1000000}
+KILO_FPS=${KILO_FPS:-0}
+export KILO_FPS
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/kilo-bench.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$LINES" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "int row%d = %d; /* the quick brown fox jumps over the lazy dog */\n", i, i * 7
+}' > "$DIR/big.c"
+
+# typing: prose with newlines and a few corrections, halfway down the file
+awk -v n="$LINES" 'BEGIN {
+    printf "\007%d\r", n / 2
+    for (i = 0; i < 400; i++) {
+        printf "the quick brown fox jumps"
+        printf "\177\177\177\177\177jumps over the lazy dog\r"
+    }
+}' > "$DIR/typing"
+
+# paste: one bracketed paste of 100k lines, then its undo and redo
+awk 'BEGIN {
+    printf "\033[200~"
+    for (i = 0; i < 100000; i++) printf "pasted line %d of the clipboard\n", i
+    printf "\033[201~\032\031"
+}' > "$DIR/paste"
+
+# search: incremental queries stepping through matches, literal and regex
+awk 'BEGIN {
+    printf "\006row99999"
+    for (i = 0; i < 20; i++) printf "\033[B"
+    printf "\r\006lazy dog"
+    for (i = 0; i < 200; i++) printf "\033[B"
+    printf "\r\006\022row[0-9]+7 ="
+    for (i = 0; i < 50; i++) printf "\033[B"
+    printf "\r"
+}' > "$DIR/search"
+
+# scroll: page through the top, jump to the end and page back up
+awk -v n="$LINES" 'BEGIN {
+    for (i = 0; i < 2000; i++) printf "\033[6~"
+    printf "\007%d\r", n
+    for (i = 0; i < 2000; i++) printf "\033[5~"
+    for (i = 0; i < 2000; i++) printf "\033[B"
+}' > "$DIR/scroll"
+
+# save: edits between background saves of the whole file
+awk 'BEGIN {
+    for (i = 0; i < 5; i++) {
+        printf "edit %d\r\023", i
+        for (j = 0; j < 100; j++) printf "x"
+    }
+}' > "$DIR/save"
+
+for trace in typing paste search scroll save; do
+    "$KILO" -b "$DIR/$trace" "$DIR/big.c" || exit 1
+done
@@ -7,21 +7,76 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 1
+#define KILO_MESSAGE_TIMEOUT 5      // seconds a status message stays up
+#define KILO_ESC_TIMEOUT 100        // ms to wait for the rest of an escape sequence
+#define KILO_PASTE_TIMEOUT 1000     // ms of silence that ends a paste missing its ESC [ 201 ~
+#define KILO_FPS 60                 // frame rate cap, KILO_FPS in the environment overrides it
+#define KILO_ROW_BLOCK 512
+#define KILO_INPUT_BUF 65536
+#define KILO_FIND_CHUNK 16384
+#define KILO_FIND_CANCEL (4 * 1024 * 1024)  // bytes of a row scanned between cancel checks, a power of two
+#define KILO_MAX_WORKERS 8
+#define KILO_OPEN_CHUNK (16 * 1024 * 1024)   // least bytes of file per loading thread
+#define KILO_SAVE_IOV 1024              // even, at most IOV_MAX
+#define KILO_SAVE_IN_PLACE (256 * 1024 * 1024)  // most bytes a save rewrites in place
+#define KILO_UNDO_CHUNK 65536
+#define KILO_SLAB_PAGE (1024 * 1024)
+#define KILO_FOLLOW_CHUNK (1024 * 1024)
+#define KILO_LONG_LINE 65536            // rows longer than this get a column index
+#define KILO_COL_STEP 4096              // text bytes per column index entry
+#define KILO_COL_SLOTS 4                // rows with a column index at a time
+#define KILO_SPILL_SEG (64 * 1024 * 1024)   // bytes of spill file mapped at a time
+#define KILO_TRIM_ROWS 16384            // rows loaded between two memory trims
+#define KILO_FAULT_AROUND 65536         // bytes the kernel maps around a faulting file page
+#define KILO_TRIM_SWEEP 4096            // blocks a memory trim looks at, at most
+#define KILO_JOURNAL_DELAY 200          // ms an edit waits in memory before the journal syncs
+#ifndef KILO_RENDER_CAP
+#define KILO_RENDER_CAP (16 * 1024 * 1024)  // bytes of render kept around
+#endif
+#ifndef KILO_TRACE_EVENTS
+#define KILO_TRACE_EVENTS (1 << 20)     // events kept for the KILO_TRACE dump
+#endif
+#ifndef KILO_UNDO_LIMIT
+#define KILO_UNDO_LIMIT (16 * 1024 * 1024)  // bytes of undo history kept
+#endif
 
 #define CTRL_KEY(key) ((key) & 0x1f)
 
@@ -35,18 +90,77 @@ enum editorKey{
     PAGE_UP,        //REPAG
     PAGE_DOWN,      //AVPAG
     HOME_KEY,
-    END_KEY
+    END_KEY,
+    PASTE_START,
+    PASTE_END,
+    WAKE_KEY        // a background thread has something for the UI
+};
+
+enum cellAttr{
+    ATTR_NORMAL = 0,
+    ATTR_INVERSE,
+    ATTR_COMMENT,
+    ATTR_KEYWORD1,
+    ATTR_KEYWORD2,
+    ATTR_STRING,
+    ATTR_NUMBER,
+    ATTR_ERROR,
+    ATTR_WARNING
+};
+
+enum journalType{
+    JOURNAL_INSERT,         // text went in at row:col
+    JOURNAL_DELETE,         // row:col up to endRow:endCol came out
+    JOURNAL_DELROW          // the empty row at 'row' went away
 };
 
 /*** data ***/
 
+typedef struct screenCell{
+    unsigned long long ch;      // UTF-8 bytes from the low one up; 0 right of a wide character
+    unsigned char attr;
+} screenCell;
+
 typedef struct editorRow{
     char *text;
     int tSize;
+    int tCap;                   // slab capacity of text when owned
     char *render;
     int rSize; 
+    int rCap;
+    unsigned int gen;           // bumped on every change to text
+    unsigned int renderGen;     // gen the render was built from
+    unsigned char renderRef;    // render used since the last eviction sweep
+    unsigned char owned;        // text is malloc'd by the row, not borrowed from conf.map
+    unsigned char hlState;      // highlighter state at the end of the row
+    unsigned char utf8;         // text has multi-byte characters, as of renderGen
+    unsigned int sharedEpoch;   // saveEpoch whose snapshot also references text
 } editorRow;
 
+/* A buffer kept alive for a running save: a row text with its slab
+ * capacity, or a malloc'd rows array when cap is 0. */
+struct graveItem{
+    void *p;
+    int cap;
+};
+
+/* The buffer is a list of row blocks holding up to KILO_ROW_BLOCK rows each.
+ * A Fenwick tree over the block sizes turns a row number into a block in
+ * O(log n), and inserting or deleting a row only moves rows within a block.
+ * A second tree over the blocks' byte counts does the same for file offsets. */
+typedef struct rowBlock{
+    editorRow *rows;
+    int numRows;
+    unsigned int epoch;     // saveEpoch the rows array was last copied in
+    unsigned char stale;    // bytes needs recounting
+    unsigned char used;     // looked at since the memory trim last passed
+    unsigned char spilled;  // rows array lives in the spill file, at spillOff
+    unsigned char edited;   // rows changed since they were last known to match the file
+    long long bytes;        // text plus a newline per row
+    long long spillOff;
+    long long spillLen;     // bytes of the spill file the block holds there
+} rowBlock;
+
 struct editorConfig {
     int cX, cY;
     int rX;
@@ -55,11 +169,71 @@ struct editorConfig {
     int screenRows;
     int screenCols;
     int numRows;
-    editorRow *eRow;
+    rowBlock *blocks;
+    int *blockFen;
+    long long *byteFen;
+    int byteFenValid;       // byteFen matches the block list, less the stale blocks
+    unsigned int byteGen;   // bumped by every change that can move a file offset
+    int statusRow;          // row whose offset statusOff holds, as of statusGen
+    unsigned int statusGen;
+    long long statusOff;
+    int *staleBlocks;
+    int numStale, staleCap;
+    int numBlocks;
+    int blockCap;
+    char *map;
+    size_t mapSize;
+    int mapLive;            // conf.map is of the file on disk, as mapStat says it is
+    struct stat mapStat;
+    size_t renderBytes;
+    int evictHand;
     int dirty;
     char *filename;
+    struct editorSyntax *syntax;    // NULL when the file type is not known
+    int hlValid;                // rows whose hlState is up to date
+    int hlTail;                 // rows before this are up to date for their old start state
+    unsigned char *hlText, *hlRender;   // scratch for highlighting one row
+    int hlTextCap, hlRenderCap;
+    double openMs;              // how long editorOpen() took
+    char *followPath;           // file followed with -f, or NULL
+    int followFd, followWd;     // inotify instance and its watch
+    int followDirWd;            // watch on the directory, to see the path replaced
+    int followReplaced;         // the path may name another file now
+    int followFile;             // the file, read from followOff on
+    long long followOff;
+    int followPartial;          // the last row has no newline yet
+    int followDeferred;         // appends wait for a search to finish
+    char *followBuf;
+    struct saveJob *saveJob;    // save running in the background
+    struct saveJob *settleJob;  // in-place save waiting for a search to finish
+    int saveAgain;              // Ctrl-S came in while a save was running
+    unsigned int saveEpoch;
+    struct graveItem *grave;    // buffers to free once the save is done
+    int numGrave, graveCap;
     char statusmsg[80];
     time_t statusmsgTime;
+    screenCell *frame;      // the frame being composed
+    screenCell *shadow;     // what the terminal currently shows
+    int frameRows, frameCols;
+    int shadowValid;
+    int shadowCY, shadowCX;
+    int frameBytes;
+    long long findIndex, findTotal;     // "match i of N" while searching
+    int findBusy;
+    int findRegex;                      // search prompt takes a pattern
+    const char *findError;              // why the pattern did not compile
+    int wakeFd[2];
+    int epollFd;
+    int sigFd;              // SIGWINCH, SIGHUP and SIGTERM
+    int timerFd;            // status message expiry
+    int frameTimerFd;       // a frame that was held back is due
+    double frameInterval;   // ms, 0 to paint after every key
+    double lastFrame;
+    int framePending;       // a frame was held back
+    int inFd, outFd;        // the terminal, or a trace and /dev/null when benchmarking
+    unsigned char inBuf[KILO_INPUT_BUF];    // ring of bytes read from inFd
+    int inHead, inLen;
+    int inEof;              // read() hit the end of inFd
     struct termios origTermios;
 };
 
@@ -70,6 +244,214 @@ struct editorConfig conf;
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void(*callback)(char *, int));
+void editorInsertText(const char *s, size_t len);
+void editorDelRange(int row, int col, int endRow, int endCol);
+void editorHlEdit(int at, int delta);
+void editorColForget();
+double editorNowMs();
+void die(const char *s);
+void editorFollowReopen(long long off);
+void editorFollowPoll();
+void editorResize();
+void editorMemTrim(int spill);
+long long editorWritev(int fd, struct iovec *iov, int n);
+int blockFenSum(int b);
+long long blockCountBytes(rowBlock *blk);
+char *editorNewText(const char *s, size_t len, int *cap);
+void editorJournal(int type, int row, int col, int endRow, int endCol, const char *text, size_t len);
+void editorJournalClose(int remove);
+void editorSaveWait();
+void editorSave();
+
+/*** bench ***/
+
+/* With -b, keys come from a trace file instead of the terminal and frames
+ * go to /dev/null on a fixed size screen. Each key is timed from when it is
+ * read until the editor asks for the next one, which covers handling it and
+ * drawing the frame after it, and quitting or running out of trace prints
+ * a report. The traces "make bench" replays are generated by bench/bench.sh. */
+struct benchState{
+    int on;
+    int eof;                // the whole trace has been read
+    const char *trace;
+    double keyStart;        // when the key being handled was read, or 0
+    double start;
+    float *lat;             // per-key latencies in microseconds
+    int numLat, latCap;
+    long long frames, frameBytes;
+} bench;
+
+void benchKeyEnd(){
+    if (bench.keyStart == 0) return;
+
+    double now = editorNowMs();
+    if (bench.numLat == bench.latCap){
+        bench.latCap = bench.latCap ? bench.latCap * 2 : 4096;
+        bench.lat = realloc(bench.lat, sizeof(float) * bench.latCap);
+    }
+    bench.lat[bench.numLat++] = (now - bench.keyStart) * 1000;
+    bench.keyStart = 0;
+}
+
+int benchCmp(const void *a, const void *b){
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+void benchReport(){
+    double ms = editorNowMs() - bench.start;
+    benchKeyEnd();
+    qsort(bench.lat, bench.numLat, sizeof(float), benchCmp);
+
+    float p50 = 0, p99 = 0, max = 0;
+    if (bench.numLat){
+        p50 = bench.lat[bench.numLat / 2];
+        p99 = bench.lat[(int)(bench.numLat * 0.99)];
+        max = bench.lat[bench.numLat - 1];
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    const char *name = strrchr(bench.trace, '/');
+    printf("%-10s open %6.1f ms | %7d keys %8.0f keys/s | p50 %7.1f us p99 %8.1f us max %8.1f us | "
+           "%5lld frames %6lld B/frame | peak RSS %ld MB\n",
+           name ? name + 1 : bench.trace, conf.openMs, bench.numLat,
+           ms > 0 ? bench.numLat / (ms / 1000) : 0, p50, p99, max, bench.frames,
+           bench.frames ? bench.frameBytes / bench.frames : 0, ru.ru_maxrss / 1024);
+}
+
+void benchStart(){
+    conf.inFd = open(bench.trace, O_RDONLY | O_CLOEXEC);
+    if (conf.inFd == -1) die(bench.trace);
+    conf.outFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (conf.outFd == -1) die("/dev/null");
+
+    bench.start = editorNowMs();
+    atexit(benchReport);
+}
+
+/*** perf ***/
+
+/* Probes around the hot paths of a frame. They only read the clock while
+ * the overlay is up (Ctrl-P) or KILO_TRACE names a file to write a Chrome
+ * trace (chrome://tracing, Perfetto) to on exit. The overlay shows the
+ * totals of the last frame. Search workers add their chunk scans to the
+ * trace, with one track per worker. */
+enum perfProbe{
+    PERF_FRAME = 0,
+    PERF_INPUT,
+    PERF_KEY,
+    PERF_ROW,
+    PERF_HL,
+    PERF_SEARCH,
+    PERF_DRAW,
+    PERF_FLUSH,
+    PERF_WRITE,
+    PERF_PROBES
+};
+
+const char *perfNames[PERF_PROBES] = {
+    "frame", "input", "key", "row", "hl", "search", "draw", "flush", "write"
+};
+
+typedef struct perfEvent{
+    long long start, dur;   // ns
+    unsigned char probe;
+    unsigned char tid;      // 0 for the UI thread, 1 + slot for search workers
+} perfEvent;
+
+struct perfState{
+    int on;                 // probes are live
+    int overlay;
+    const char *traceFile;
+    perfEvent *events;
+    int numEvents;          // may run past KILO_TRACE_EVENTS, which drops the rest
+    long long origin;
+    long long keyStart;     // when the key being handled was read, or 0
+    long long cur[PERF_PROBES], curCount[PERF_PROBES];
+    long long last[PERF_PROBES], lastCount[PERF_PROBES];
+    long long allocs, frees;            // slab counters when the frame started
+    long long lastAllocs, lastFrees;
+} perf;
+
+long long perfNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long perfBegin(){
+    return perf.on ? perfNow() : 0;
+}
+
+/* Safe to call from any thread. */
+void perfTrace(int probe, int tid, long long start, long long dur){
+    if (perf.events == NULL) return;
+    int i = __atomic_fetch_add(&perf.numEvents, 1, __ATOMIC_RELAXED);
+    if (i >= KILO_TRACE_EVENTS) return;
+
+    perfEvent *ev = &perf.events[i];
+    ev->start = start;
+    ev->dur = dur;
+    ev->probe = probe;
+    ev->tid = tid;
+}
+
+/* Closes a probe opened on the UI thread. */
+void perfEnd(int probe, long long start){
+    if (!perf.on || start == 0) return;
+    long long dur = perfNow() - start;
+    perf.cur[probe] += dur;
+    perf.curCount[probe]++;
+    perfTrace(probe, 0, start, dur);
+}
+
+void perfFrameEnd(){
+    memcpy(perf.last, perf.cur, sizeof(perf.cur));
+    memcpy(perf.lastCount, perf.curCount, sizeof(perf.curCount));
+    memset(perf.cur, 0, sizeof(perf.cur));
+    memset(perf.curCount, 0, sizeof(perf.curCount));
+}
+
+void perfDump(){
+    FILE *fp = fopen(perf.traceFile, "w");
+    if (fp == NULL){
+        perror(perf.traceFile);
+        return;
+    }
+
+    int n = perf.numEvents < KILO_TRACE_EVENTS ? perf.numEvents : KILO_TRACE_EVENTS;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (int i = 0; i < n; i++){
+        perfEvent *ev = &perf.events[i];
+        fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+                perfNames[ev->probe], ev->tid, (ev->start - perf.origin) / 1e3, ev->dur / 1e3);
+    }
+    for (int t = 1; t <= KILO_MAX_WORKERS; t++)
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"search %d\"}},\n", t, t);
+    fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"ui\"}}\n");
+    fprintf(fp, "],\"otherData\":{\"dropped\":%d}}\n", perf.numEvents - n);
+    fclose(fp);
+}
+
+void perfInit(){
+    perf.traceFile = getenv("KILO_TRACE");
+    if (perf.traceFile == NULL || perf.traceFile[0] == '\0') return;
+
+    perf.events = malloc(sizeof(perfEvent) * KILO_TRACE_EVENTS);
+    perf.origin = perfNow();
+    perf.on = 1;
+    atexit(perfDump);
+}
+
+void perfToggleOverlay(){
+    perf.overlay = !perf.overlay;
+    perf.on = perf.overlay || perf.events;
+    memset(perf.cur, 0, sizeof(perf.cur));
+    memset(perf.curCount, 0, sizeof(perf.curCount));
+    perfFrameEnd();
+}
 
 /*** terminal ***/
 
@@ -82,7 +464,8 @@ void die(const char *s){
 }
 
 void disableRawMode(){
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &conf.origTermios) != 1)
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &conf.origTermios) == -1)
         die("tcsetattr");
 }
 
@@ -97,37 +480,196 @@ void enableRawMode(){
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/* Input is read into the conf.inBuf ring in chunks as large as the terminal
+ * hands over, so a burst of keys or a paste costs one read() per chunk
+ * rather than one per byte. Returns 0 if nothing was there. */
+int inputFill(){
+    if (conf.inLen == KILO_INPUT_BUF) return 1;
+
+    int tail = (conf.inHead + conf.inLen) % KILO_INPUT_BUF;
+    int room = tail >= conf.inHead ? KILO_INPUT_BUF - tail : conf.inHead - tail;
+
+    long long start = perfBegin();
+    int nread = read(conf.inFd, &conf.inBuf[tail], room);
+    perfEnd(PERF_INPUT, start);
+    if (nread == -1 && errno != EAGAIN) die("read");
+    if (nread == 0) conf.inEof = 1;
+    if (nread == 0 && bench.on) bench.eof = 1;
+    if (nread <= 0) return 0;
+
+    conf.inLen += nread;
+    return 1;
+}
+
+/* Background threads write a byte to conf.wakeFd to get the UI thread out of
+ * editorReadKey(). */
+void editorWake(){
+    char c = 0;
+    write(conf.wakeFd[1], &c, 1);
+}
+
+/* Empties the wake pipe, returning whether anything was in it. */
+int inputWoken(){
+    char buf[64];
+    int woken = 0;
+    while (read(conf.wakeFd[0], buf, sizeof(buf)) > 0) woken = 1;
+    return woken;
+}
+
+/* A replay has the next key at once, where a person would have seen the
+ * save or search it depends on finish first: a Ctrl-S waits for the save
+ * running and an arrow key in the search prompt for the search. */
+int benchHold(){
+    if (conf.inLen < 3) inputFill();
+    if (conf.inLen == 0) return 0;
+
+    char c = conf.inBuf[conf.inHead];
+    if (c == CTRL_KEY('s')) return conf.saveJob != NULL;
+    if (c != '\x1b' || !conf.findBusy || conf.inLen < 3) return 0;
+
+    char c1 = conf.inBuf[(conf.inHead + 1) % KILO_INPUT_BUF];
+    char c2 = conf.inBuf[(conf.inHead + 2) % KILO_INPUT_BUF];
+    return c1 == '[' && c2 >= 'A' && c2 <= 'D';
+}
+
+/* Everything the UI thread waits on goes through one epoll set, so an idle
+ * editor sleeps until there is something to do. */
+enum editorEvent{
+    EV_INPUT = 0,
+    EV_WAKE,
+    EV_SIGNAL,
+    EV_TIMER,
+    EV_FOLLOW
+};
+
+void editorWatch(int fd, int ev){
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = ev};
+    if (epoll_ctl(conf.epollFd, EPOLL_CTL_ADD, fd, &event) == -1) die("epoll_ctl");
+}
+
+/* Blocks until input arrives or something else needs the screen redrawn:
+ * a background thread called editorWake(), the window was resized, a
+ * timer expired or a followed file grew. Returns 1 for those. */
+int inputWait(){
+    if (bench.on && !bench.eof && !benchHold()) return 0;
+
+    struct epoll_event events[8];
+    int n;
+    while ((n = epoll_wait(conf.epollFd, events, 8, -1)) == -1)
+        if (errno != EINTR) die("epoll_wait");
+
+    int wake = 0;
+    for (int i = 0; i < n; i++){
+        switch (events[i].data.u32){
+            case EV_WAKE:
+                inputWoken();
+                wake = 1;
+                break;
+            case EV_SIGNAL: {
+                struct signalfd_siginfo si;
+                while (read(conf.sigFd, &si, sizeof(si)) > 0){
+                    /* The terminal went away or we were told to go: let a
+                     * save in flight finish, get the journal on disk and
+                     * leave it for next time. */
+                    if (si.ssi_signo == SIGHUP || si.ssi_signo == SIGTERM){
+                        editorSaveWait();
+                        editorJournalClose(0);
+                        exit(1);
+                    }
+                }
+                editorResize();
+                wake = 1;
+                break;
+            }
+            case EV_TIMER: {
+                unsigned long long expired;
+                read(conf.timerFd, &expired, sizeof(expired));
+                read(conf.frameTimerFd, &expired, sizeof(expired));
+                wake = 1;
+                break;
+            }
+            case EV_FOLLOW:
+                wake = 1;
+                break;
+        }
+    }
+    return wake;
+}
+
+/* The next byte, waiting up to KILO_ESC_TIMEOUT for it. */
+int inputGetc(char *c){
+    if (conf.inLen == 0){
+        struct pollfd pfd = {conf.inFd, POLLIN, 0};
+        if (poll(&pfd, 1, KILO_ESC_TIMEOUT) <= 0 || !inputFill()) return 0;
+    }
+
+    *c = conf.inBuf[conf.inHead];
+    conf.inHead = (conf.inHead + 1) % KILO_INPUT_BUF;
+    conf.inLen--;
+    return 1;
+}
+
+/* Whether there are bytes read but not yet handled, or waiting on inFd. */
+int inputPending(){
+    if (conf.inLen > 0) return 1;
+    struct pollfd pfd = {conf.inFd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
 }
 
 int editorReadKey(){
-    int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+    if (bench.on){
+        benchKeyEnd();
+        /* Trace input never blocks, so wakes are picked up between keys. */
+        if (inputWoken()) return WAKE_KEY;
+        while (benchHold())
+            if (inputWait()) return WAKE_KEY;
+    }
+    while (conf.inLen == 0){
+        if (bench.eof && !conf.saveJob && !conf.findBusy && !conf.framePending){
+            editorJournalClose(1);
+            exit(0);
+        }
+        if (inputWait()) return WAKE_KEY;
+        inputFill();
     }
+    inputGetc(&c);
+    if (bench.on) bench.keyStart = editorNowMs();
+    if (perf.on) perf.keyStart = perfNow();
 
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (!inputGetc(&seq[0])) return '\x1b';
+        if (!inputGetc(&seq[1])) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9'){
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                int num = seq[1] - '0';
+                while (1){
+                    if (!inputGetc(&seq[2])) return '\x1b';
+                    if (seq[2] < '0' || seq[2] > '9') break;
+                    num = num * 10 + seq[2] - '0';
+                }
                 
                 if (seq[2] == '~')
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
+                    switch (num) {
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        case 200: return PASTE_START;
+                        case 201: return PASTE_END;
                     }
             }
             else
@@ -148,16 +690,55 @@ int editorReadKey(){
 
         return '\x1b';
     } else 
-        return c;
+        return (unsigned char)c;
+}
+
+/* Collects a bracketed paste after PASTE_START up to the closing
+ * ESC [ 201 ~, straight from the input ring. If input ends or goes quiet
+ * before it comes, what was collected is the paste. */
+char *editorReadPaste(size_t *len){
+    static const char end[] = "\x1b[201~";
+    size_t endLen = sizeof(end) - 1;
+    size_t cap = 4096;
+    char *buf = malloc(cap);
+    size_t n = 0;
+    double idleSince = 0;
+
+    while (1){
+        char c;
+        if (!inputGetc(&c)){
+            double now = editorNowMs();
+            if (idleSince == 0) idleSince = now;
+            if (conf.inEof || now - idleSince > KILO_PASTE_TIMEOUT) break;
+            continue;
+        }
+        idleSince = 0;
+
+        if (n == cap){
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        buf[n++] = c;
+
+        if (n >= endLen && c == '~' && memcmp(&buf[n - endLen], end, endLen) == 0){
+            n -= endLen;
+            break;
+        }
+    }
+
+    *len = n;
+    return buf;
 }
 
 int getCursorPosition(int *rows, int *cols){
     char buf[32];
     unsigned int i=0;
 
-    if (write(STDOUT_FILENO, "\x1b[6b", 4) != 4) return -1;
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
     
     while (i < sizeof(buf)-1){
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, KILO_ESC_TIMEOUT) <= 0) break;
         if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
         if (buf[i] == 'R') break;
         i++;
@@ -185,262 +766,4758 @@ int getWindowSize(int *rows, int *cols){
     }
 }
 
-/*** row operations ***/
+/*** row storage ***/
+
+/* Row text and render buffers come from size-class slabs carved out of
+ * KILO_SLAB_PAGE pages, with a free list per class. Classes go up in steps
+ * of 8 bytes to 64 and then in quarters of a power of two up to 64KB, so a
+ * buffer wastes at most a fifth of its size. A buffer that outgrows its
+ * class moves to the one fitting its new size, so a row being typed into
+ * is copied O(log n) times rather than on every key.
+ * Pages are only handed back all at once by slabFreeAll(). Building with
+ * -DKILO_MALLOC_ROWS switches to exact-size malloc per buffer, to compare. */
+
+#define SLAB_MAX_SHIFT 16
+#define SLAB_CLASSES (8 + (SLAB_MAX_SHIFT - 6) * 4)
+
+/* Buffers above the largest class are malloc'd behind this header, which
+ * keeps them on a list slabFreeAll() can walk. */
+typedef struct slabLarge{
+    struct slabLarge *prev, *next;
+} slabLarge;
+
+struct slabState{
+    void *free[SLAB_CLASSES];
+    char *bump, *bumpEnd;       // unused tail of the newest page
+    char **pages;
+    int numPages, pagesCap;
+    slabLarge *large;
+    long long allocs, frees;
+    size_t liveBytes;           // capacity handed out and not freed
+    size_t reservedBytes;       // pages plus large buffers
+} slab;
+
+int slabClass(size_t want){
+    if (want <= 64) return want ? (want - 1) / 8 : 0;
+
+    int e = 6;
+    while (((size_t)2 << e) < want) e++;
+    return 8 + (e - 6) * 4 + (want - 1 - ((size_t)1 << e)) / ((size_t)1 << (e - 2));
+}
 
-int editorRowCxToRx(editorRow *erow, int cX){
-    int rX =0;
-    for (int j = 0; j < cX; j++){
-        if(erow->text[j] == '\t')
-            rX += (KILO_TAB_STOP - 1) - (rX % KILO_TAB_STOP);
-        rX++;
+size_t slabClassSize(int c){
+    if (c < 8) return (c + 1) * 8;
+    int e = 6 + (c - 8) / 4;
+    return ((size_t)1 << e) + ((size_t)1 << (e - 2)) * ((c - 8) % 4 + 1);
+}
+
+char *slabAlloc(size_t want, int *cap){
+    slab.allocs++;
+#ifdef KILO_MALLOC_ROWS
+    *cap = want;
+    slab.liveBytes += want;
+    slab.reservedBytes += want;
+    return malloc(want);
+#else
+    if (want > ((size_t)1 << SLAB_MAX_SHIFT)){
+        size_t size = (size_t)1 << SLAB_MAX_SHIFT;
+        while (size < want) size *= 2;
+        *cap = size;
+        slab.liveBytes += size;
+        slab.reservedBytes += size;
+
+        slabLarge *l = malloc(sizeof(slabLarge) + size);
+        if (l == NULL) die("malloc");
+        l->prev = NULL;
+        l->next = slab.large;
+        if (slab.large) slab.large->prev = l;
+        slab.large = l;
+        return (char *)(l + 1);
     }
-    
-    return rX;
+
+    int c = slabClass(want);
+    size_t size = slabClassSize(c);
+    *cap = size;
+    slab.liveBytes += size;
+
+    if (slab.free[c]){
+        char *p = slab.free[c];
+        slab.free[c] = *(void **)p;
+        return p;
+    }
+
+    if (slab.bumpEnd - slab.bump < (long)size){
+        if (slab.numPages == slab.pagesCap){
+            slab.pagesCap = slab.pagesCap ? slab.pagesCap * 2 : 16;
+            slab.pages = realloc(slab.pages, sizeof(char *) * slab.pagesCap);
+        }
+        char *page = malloc(KILO_SLAB_PAGE);
+        if (page == NULL) die("malloc");
+        slab.pages[slab.numPages++] = page;
+        slab.bump = page;
+        slab.bumpEnd = page + KILO_SLAB_PAGE;
+        slab.reservedBytes += KILO_SLAB_PAGE;
+    }
+
+    char *p = slab.bump;
+    slab.bump += size;
+    return p;
+#endif
 }
 
-int editorRowRxToCx(editorRow *eRow, int rx) {
-  int cur_rX = 0;
-  int cX;
-  for (cX = 0; cX < eRow->tSize; cX++) {
-    if (eRow->text[cX] == '\t')
-      cur_rX += (KILO_TAB_STOP - 1) - (cur_rX % KILO_TAB_STOP);
-    cur_rX++;
-    if (cur_rX > rx) return cX;
-  }
-  return cX;
+void slabFree(void *p, int cap){
+    if (p == NULL) return;
+    slab.frees++;
+    slab.liveBytes -= cap;
+#ifdef KILO_MALLOC_ROWS
+    slab.reservedBytes -= cap;
+    free(p);
+#else
+    if ((size_t)cap > ((size_t)1 << SLAB_MAX_SHIFT)){
+        slabLarge *l = (slabLarge *)p - 1;
+        if (l->prev) l->prev->next = l->next;
+        else slab.large = l->next;
+        if (l->next) l->next->prev = l->prev;
+        slab.reservedBytes -= cap;
+        free(l);
+        return;
+    }
+    int c = slabClass(cap);
+    *(void **)p = slab.free[c];
+    slab.free[c] = p;
+#endif
 }
 
-void editorUpdateRow(editorRow *erow){
-    int tabs = 0;
-    for (int j = 0; j < erow->tSize; j++)
-        if (erow->text[j] == '\0') tabs++;
-    
-    free(erow->render);
-    erow->render = malloc(erow->tSize + tabs*(KILO_TAB_STOP-1) + 1);
+/* Grows p to hold at least 'need' bytes, keeping the first 'used'. */
+char *slabGrow(char *p, int *cap, size_t used, size_t need){
+    if (p && need <= (size_t)*cap) return p;
+#ifdef KILO_MALLOC_ROWS
+    (void)used;
+    slab.allocs++;
+    slab.liveBytes += need - *cap;
+    slab.reservedBytes += need - *cap;
+    *cap = need;
+    return realloc(p, need);
+#else
+    int newCap;
+    char *q = slabAlloc(need, &newCap);
+    if (used) memcpy(q, p, used);
+    slabFree(p, *cap);
+    *cap = newCap;
+    return q;
+#endif
+}
 
-    int idx = 0;
-    for (int j = 0; j < erow->tSize; j++){
-        if(erow->text[j] == '\t'){
-            erow->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0) erow->render[idx++] = ' ';
-        } else
-            erow->render[idx++] = erow->text[j];
+/* Drops every row buffer at once. Only for when no row is left using one. */
+void slabFreeAll(){
+#ifndef KILO_MALLOC_ROWS
+    for (int i = 0; i < slab.numPages; i++) free(slab.pages[i]);
+    while (slab.large){
+        slabLarge *next = slab.large->next;
+        free(slab.large);
+        slab.large = next;
     }
+    slab.numPages = 0;
+    slab.liveBytes = 0;
+    slab.reservedBytes = 0;
+    slab.bump = slab.bumpEnd = NULL;
+    memset(slab.free, 0, sizeof(slab.free));
+#endif
+}
 
-    erow->render[idx] = '\0';
-    erow->rSize = idx;
+/*** memory budget ***/
+
+/* With -m, resident memory is kept under a budget. When it goes over, a
+ * clock sweep over the row blocks finds the ones not looked at since the
+ * hand last passed and skips those on screen. A cold block has its rows
+ * array and owned texts written to an unlinked spill file, mapped back in
+ * shared so the rows borrow from it the way they borrow from conf.map, and
+ * the pages its rows borrow are handed back to the kernel. Drawing,
+ * searching or saving those rows just faults the pages in again, and the
+ * first edit copies the rows array back out, see blockThaw(). Nothing is
+ * spilled while a save or a search may be reading the rows arrays; pages
+ * are dropped either way. Memory freed by spilling goes back to the slab
+ * and malloc, which reuse it for the rows that come next rather than
+ * returning it, so resident memory levels off under the budget. The spill
+ * file levels off too: thawing a block copies its texts back out as well,
+ * so nothing refers to its stretch of the file any more and the next spill
+ * can fill it again. */
+struct memState{
+    size_t limit;           // bytes, 0 for no budget
+    int hand;               // next block the sweep looks at
+    int statmFd;
+    int spillFd;            // -1 until the first spill
+    int failed;             // the spill file can't be used, only drop pages
+    char **segs;            // the spill file, KILO_SPILL_SEG bytes at a time
+    int numSegs, segCap;
+    long long spillEnd;     // bytes of the spill file handed out so far
+    long long *freeOff;     // stretches before spillEnd nothing uses
+    long long *freeLen;
+    int numFree, freeCap;
+    long long idleRows;     // rows arrays freed and not handed out again yet
+} mem = {0, 0, -1, -1, 0, NULL, 0, 0, 0, NULL, NULL, 0, 0, 0};
+
+size_t memResident(){
+    if (mem.statmFd == -1) mem.statmFd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+
+    char buf[64];
+    ssize_t n = pread(mem.statmFd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+
+    unsigned long size, resident;
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2) return 0;
+    return resident * sysconf(_SC_PAGESIZE);
 }
 
-void editorInsertRow(int at, char *s, size_t len){
-    if (at < 0 || at > conf.numRows) return;
+/* Resident memory less what the slab and malloc keep for reuse. */
+size_t memInUse(){
+    size_t resident = memResident();
+    size_t idle = slab.reservedBytes - slab.liveBytes + mem.idleRows * sizeof(editorRow) * KILO_ROW_BLOCK;
+    return resident > idle ? resident - idle : 0;
+}
+
+/* Parses a -m argument: a byte count with an optional K, M or G. */
+size_t memParseSize(const char *s){
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+    switch (*end){
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'm': case 'M': n <<= 20; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return end == s || *end ? 0 : n;
+}
+
+/* The spill file lives in $TMPDIR, or /var/tmp since /tmp is often in
+ * memory, and has no name from the start where the filesystem allows. */
+int memSpillOpen(){
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') dir = "/var/tmp";
+
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1){
+        size_t len = strlen(dir) + 20;
+        char *path = malloc(len);
+        snprintf(path, len, "%s/kilo-spill.XXXXXX", dir);
+        fd = mkstemp(path);
+        if (fd != -1) unlink(path);
+        free(path);
+    }
+    return fd;
+}
+
+/* Room for *len bytes in the spill file, within one segment. The length is
+ * rounded up to whole pages, so stretches given back fit the spills that
+ * come after them. Stores the file offset and length and returns where it
+ * is mapped. */
+char *memSpillAlloc(long long *len, long long *off){
+    long long page = sysconf(_SC_PAGESIZE);
+    *len = (*len + page - 1) & ~(page - 1);
+    if (mem.failed || *len > KILO_SPILL_SEG) return NULL;
+    if (mem.spillFd == -1 && (mem.spillFd = memSpillOpen()) == -1){
+        mem.failed = 1;
+        editorSetStatusMessage("Can't open spill file: %s", strerror(errno));
+        return NULL;
+    }
+
+    for (int i = 0; i < mem.numFree; i++){
+        if (mem.freeLen[i] < *len) continue;
+        *off = mem.freeOff[i];
+        mem.freeOff[i] += *len;
+        mem.freeLen[i] -= *len;
+        if (mem.freeLen[i] == 0){
+            mem.freeOff[i] = mem.freeOff[--mem.numFree];
+            mem.freeLen[i] = mem.freeLen[mem.numFree];
+        }
+        return mem.segs[*off / KILO_SPILL_SEG] + *off % KILO_SPILL_SEG;
+    }
+
+    long long start = mem.spillEnd;
+    int seg = start / KILO_SPILL_SEG;
+    if (start % KILO_SPILL_SEG + *len > KILO_SPILL_SEG)
+        start = (long long)++seg * KILO_SPILL_SEG;
+
+    if (seg == mem.numSegs){
+        if (mem.numSegs == mem.segCap){
+            mem.segCap = mem.segCap ? mem.segCap * 2 : 16;
+            mem.segs = realloc(mem.segs, sizeof(char *) * mem.segCap);
+        }
+        char *p = MAP_FAILED;
+        if (ftruncate(mem.spillFd, (off_t)(seg + 1) * KILO_SPILL_SEG) == 0)
+            p = mmap(NULL, KILO_SPILL_SEG, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     mem.spillFd, (off_t)seg * KILO_SPILL_SEG);
+        if (p == MAP_FAILED){
+            mem.failed = 1;
+            editorSetStatusMessage("Can't grow spill file: %s", strerror(errno));
+            return NULL;
+        }
+        mem.segs[mem.numSegs++] = p;
+    }
+
+    mem.spillEnd = start + *len;
+    *off = start;
+    return mem.segs[seg] + start % KILO_SPILL_SEG;
+}
+
+/* Hands a stretch from memSpillAlloc() back, joined to a free neighbour in
+ * the same segment if there is one. */
+void memSpillFree(long long off, long long len){
+    for (int i = 0; i < mem.numFree; i++){
+        if (mem.freeOff[i] / KILO_SPILL_SEG != off / KILO_SPILL_SEG) continue;
+        if (mem.freeOff[i] + mem.freeLen[i] == off){
+            mem.freeLen[i] += len;
+            return;
+        }
+        if (off + len == mem.freeOff[i]){
+            mem.freeOff[i] = off;
+            mem.freeLen[i] += len;
+            return;
+        }
+    }
+
+    if (mem.numFree == mem.freeCap){
+        mem.freeCap = mem.freeCap ? mem.freeCap * 2 : 64;
+        mem.freeOff = realloc(mem.freeOff, sizeof(long long) * mem.freeCap);
+        mem.freeLen = realloc(mem.freeLen, sizeof(long long) * mem.freeCap);
+    }
+    mem.freeOff[mem.numFree] = off;
+    mem.freeLen[mem.numFree++] = len;
+}
+
+/* A rows array for a block. Arrays freed since are assumed to be reused. */
+editorRow *blockAllocRows(){
+    if (mem.idleRows) mem.idleRows--;
+    editorRow *rows = malloc(sizeof(editorRow) * KILO_ROW_BLOCK);
+    if (rows == NULL) die("malloc");
+    return rows;
+}
+
+/* A spilled rows array gives its stretch of the spill file back. */
+void blockFreeRows(rowBlock *blk){
+    if (blk->spilled){
+        memSpillFree(blk->spillOff, blk->spillLen);
+        return;
+    }
+    free(blk->rows);
+    mem.idleRows++;
+}
+
+/* Moves a block's rows array and owned texts to the spill file in one
+ * write. Texts too big for a segment stay where they are. */
+void memSpillBlock(rowBlock *blk){
+    char *oldText[KILO_ROW_BLOCK];
+    int oldCap[KILO_ROW_BLOCK];
+    struct iovec iov[KILO_ROW_BLOCK + 1];
+    size_t rowsLen = sizeof(editorRow) * blk->numRows;
+
+    long long len = rowsLen;
+    for (int j = 0; j < blk->numRows; j++){
+        editorRow *eRow = &blk->rows[j];
+        if (eRow->owned && eRow->tSize <= KILO_SPILL_SEG / 8) len += eRow->tSize;
+    }
+
+    long long off;
+    char *base = memSpillAlloc(&len, &off);
+    if (base == NULL) return;
+
+    /* Counted now, or rebuilding the byte index would read every spilled
+     * block back in. */
+    if (blk->stale && !conf.byteFenValid) blk->bytes = blockCountBytes(blk);
+
+    int n = 1;
+    char *p = base + rowsLen;
+    for (int j = 0; j < blk->numRows; j++){
+        editorRow *eRow = &blk->rows[j];
+        oldText[j] = NULL;
+        if (!eRow->owned || eRow->tSize > KILO_SPILL_SEG / 8) continue;
+
+        iov[n].iov_base = eRow->text;
+        iov[n++].iov_len = eRow->tSize;
+        oldText[j] = eRow->text;
+        oldCap[j] = eRow->tCap;
+        eRow->text = p;
+        eRow->tCap = 0;
+        eRow->owned = 0;
+        p += eRow->tSize;
+    }
+    iov[0].iov_base = blk->rows;
+    iov[0].iov_len = rowsLen;
+
+    if (lseek(mem.spillFd, off, SEEK_SET) == -1 || editorWritev(mem.spillFd, iov, n) == -1){
+        editorSetStatusMessage("Can't write spill file: %s", strerror(errno));
+        mem.failed = 1;
+        memSpillFree(off, len);
+        for (int j = 0; j < blk->numRows; j++){
+            if (oldText[j] == NULL) continue;
+            blk->rows[j].text = oldText[j];
+            blk->rows[j].tCap = oldCap[j];
+            blk->rows[j].owned = 1;
+        }
+        return;
+    }
+
+    editorColForget();
+    for (int j = 0; j < blk->numRows; j++)
+        if (oldText[j]) slabFree(oldText[j], oldCap[j]);
+    blockFreeRows(blk);
+    blk->rows = (editorRow *)base;
+    blk->spilled = 1;
+    blk->spillOff = off;
+    blk->spillLen = len;
+}
+
+/* The start of the mapping of conf.map or the spill file p is in. */
+char *memMapBase(char *p){
+    if (conf.map && p >= conf.map && p < conf.map + conf.mapSize) return conf.map;
+    for (int i = 0; i < mem.numSegs; i++)
+        if (p >= mem.segs[i] && p < mem.segs[i] + KILO_SPILL_SEG) return mem.segs[i];
+    return NULL;
+}
+
+/* Lets the kernel take back the pages from lo to hi, which are all in
+ * conf.map or the spill file and can be read back from there. Faulting in
+ * the rows after these maps in the pages around them too, so the range is
+ * widened down to where such a fault would have started. */
+void memDropRange(char *lo, char *hi){
+    char *base = lo < hi ? memMapBase(lo) : NULL;
+    if (base == NULL) return;
+
+    char *start = (char *)((size_t)lo & ~(size_t)(KILO_FAULT_AROUND - 1));
+    if (start < base) start = base;
+    madvise(start, hi - start, MADV_DONTNEED);
+}
+
+/* Drops the pages a block's rows borrow, and its rows array if it is
+ * spilled. Neighbouring texts are merged into one range as long as that
+ * covers no page outside them. */
+void memDropBlock(rowBlock *blk){
+    size_t page = sysconf(_SC_PAGESIZE);
+    editorRow *rows = blk->rows, copy[KILO_ROW_BLOCK];
+    char *lo = NULL, *hi = NULL;
+
+    /* Reading a spilled rows array through the mapping would fault it back
+     * in, and the kernel maps in the pages around it too. */
+    if (blk->spilled){
+        size_t len = sizeof(editorRow) * blk->numRows;
+        if (pread(mem.spillFd, copy, len, blk->spillOff) != (ssize_t)len) return;
+        rows = copy;
+        lo = (char *)blk->rows;
+        hi = lo + len;
+    }
+
+    for (int j = 0; j < blk->numRows; j++){
+        editorRow *eRow = &rows[j];
+        if (eRow->owned || eRow->tSize == 0) continue;
+
+        char *a = eRow->text, *z = eRow->text + eRow->tSize;
+        char *hiPage = (char *)(((size_t)hi + page - 1) & ~(page - 1));
+        if (lo && a >= lo && a <= hiPage){
+            if (z > hi) hi = z;
+        } else {
+            memDropRange(lo, hi);
+            lo = a;
+            hi = z;
+        }
+    }
+    memDropRange(lo, hi);
+}
+
+/* Once resident memory gets near the budget, sweeps cold blocks out until
+ * the memory in use is back under three quarters of it, which leaves room
+ * for what the slab and malloc hold on to. 'spill' is 0 for callers that
+ * hold row pointers, which spilling would move. */
+void editorMemTrim(int spill){
+    if (mem.limit == 0 || conf.numBlocks == 0 || memResident() <= mem.limit / 8 * 7) return;
+
+    size_t target = mem.limit / 4 * 3;
+    if (conf.saveJob || conf.findBusy) spill = 0;
+
+    for (int swept = 1; swept <= KILO_TRIM_SWEEP && swept <= 2 * conf.numBlocks; swept++){
+        if (mem.hand >= conf.numBlocks) mem.hand = 0;
+        int b = mem.hand++;
+        rowBlock *blk = &conf.blocks[b];
+
+        if (__atomic_load_n(&blk->used, __ATOMIC_RELAXED)){
+            __atomic_store_n(&blk->used, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        int first = blockFenSum(b);
+        if (first < conf.rowOff + conf.screenRows && first + blk->numRows > conf.rowOff) continue;
+        if (conf.cY >= first && conf.cY < first + blk->numRows) continue;
+
+        if (spill && !blk->spilled) memSpillBlock(blk);
+        memDropBlock(blk);
+        if (swept % 32 == 0 && memInUse() <= target) break;
+    }
+}
+
+/* Unmaps the spill file. Only for when no row is left borrowing from it. */
+void memSpillClose(){
+    for (int i = 0; i < mem.numSegs; i++) munmap(mem.segs[i], KILO_SPILL_SEG);
+    mem.numSegs = 0;
+    mem.spillEnd = 0;
+    mem.numFree = 0;
+    mem.hand = 0;
+    if (mem.spillFd != -1){
+        close(mem.spillFd);
+        mem.spillFd = -1;
+    }
+}
+
+/*** row blocks ***/
+
+void blockFenAdd(int b, int delta){
+    for (b++; b <= conf.numBlocks; b += b & -b)
+        conf.blockFen[b] += delta;
+}
+
+int blockFenSum(int b){
+    int sum = 0;
+    for (; b > 0; b -= b & -b)
+        sum += conf.blockFen[b];
+    return sum;
+}
+
+void blockFenBuild(){
+    conf.byteFenValid = 0;
+    conf.byteGen++;
+    for (int b = 1; b <= conf.numBlocks; b++)
+        conf.blockFen[b] = conf.blocks[b-1].numRows;
+    for (int b = 1; b <= conf.numBlocks; b++){
+        int parent = b + (b & -b);
+        if (parent <= conf.numBlocks) conf.blockFen[parent] += conf.blockFen[b];
+    }
+}
+
+/* Finds the block holding row 'at' and stores the row's index inside it. */
+int blockFind(int at, int *off){
+    int b = 0;
+    int step = 1;
+    while (step * 2 <= conf.numBlocks) step *= 2;
+
+    for (; step; step /= 2){
+        if (b + step <= conf.numBlocks && conf.blockFen[b + step] <= at){
+            b += step;
+            at -= conf.blockFen[b];
+        }
+    }
+
+    *off = at;
+    return b;
+}
+
+/* Opens an empty block at index b. Appending is O(log n); anything else
+ * shifts the block list and rebuilds the tree, which only happens once per
+ * KILO_ROW_BLOCK/2 inserted rows. */
+void blockInsert(int b){
+    if (conf.numBlocks == conf.blockCap){
+        conf.blockCap = conf.blockCap ? conf.blockCap * 2 : 16;
+        conf.blocks = realloc(conf.blocks, sizeof(rowBlock) * conf.blockCap);
+        conf.blockFen = realloc(conf.blockFen, sizeof(int) * (conf.blockCap + 1));
+    }
+
+    memmove(&conf.blocks[b+1], &conf.blocks[b], sizeof(rowBlock) * (conf.numBlocks - b));
+    conf.blocks[b].rows = blockAllocRows();
+    conf.blocks[b].numRows = 0;
+    conf.blocks[b].epoch = conf.saveEpoch;
+    conf.blocks[b].stale = 1;
+    conf.blocks[b].used = 1;
+    conf.blocks[b].spilled = 0;
+    conf.blocks[b].bytes = 0;
+    conf.blocks[b].edited = 1;
+    conf.numBlocks++;
+    conf.byteFenValid = 0;
+    conf.byteGen++;
+
+    if (b == conf.numBlocks - 1){
+        int i = conf.numBlocks;
+        conf.blockFen[i] = blockFenSum(i - 1) - blockFenSum(i - (i & -i));
+    } else
+        blockFenBuild();
+}
+
+void blockRemove(int b){
+    blockFreeRows(&conf.blocks[b]);
+    memmove(&conf.blocks[b], &conf.blocks[b+1], sizeof(rowBlock) * (conf.numBlocks - b - 1));
+    conf.numBlocks--;
+    blockFenBuild();
+}
+
+/* A background save works from a copy of the block list taken when it
+ * starts, and reads the rows arrays and texts those blocks point to. While
+ * it runs, a block is only changed after blockThaw() gave it a rows array
+ * of its own, and texts the snapshot still references are copied before
+ * they are written. Whatever the snapshot references goes to the grave and
+ * is freed when the save finishes. */
+void editorGraveAdd(void *p, int cap){
+    if (conf.numGrave == conf.graveCap){
+        conf.graveCap = conf.graveCap ? conf.graveCap * 2 : 64;
+        conf.grave = realloc(conf.grave, sizeof(struct graveItem) * conf.graveCap);
+    }
+    conf.grave[conf.numGrave].p = p;
+    conf.grave[conf.numGrave++].cap = cap;
+}
+
+void editorGraveFree(){
+    for (int i = 0; i < conf.numGrave; i++){
+        if (conf.grave[i].cap) slabFree(conf.grave[i].p, conf.grave[i].cap);
+        else free(conf.grave[i].p);
+    }
+    conf.numGrave = 0;
+}
+
+/* Also brings a spilled rows array back into memory, with the texts that
+ * were spilled along, so the blocks being edited are never the ones in the
+ * spill file and its stretch of the file can be filled again. */
+void blockThaw(int b){
+    rowBlock *blk = &conf.blocks[b];
+    int shared = conf.saveJob && blk->epoch != conf.saveEpoch;
+    if (!shared && !blk->spilled) return;
+
+    editorColForget();
+    editorRow *rows = blockAllocRows();
+    memcpy(rows, blk->rows, sizeof(editorRow) * blk->numRows);
+    if (shared){
+        for (int j = 0; j < blk->numRows; j++) rows[j].sharedEpoch = conf.saveEpoch;
+        if (!blk->spilled) editorGraveAdd(blk->rows, 0);
+    }
+    if (blk->spilled){
+        char *lo = (char *)blk->rows, *hi = lo + blk->spillLen;
+        for (int j = 0; j < blk->numRows; j++){
+            editorRow *eRow = &rows[j];
+            if (eRow->owned || eRow->text < lo || eRow->text >= hi) continue;
+            eRow->text = editorNewText(eRow->text, eRow->tSize, &eRow->tCap);
+            eRow->owned = 1;
+            eRow->sharedEpoch = 0;
+        }
+        memSpillFree(blk->spillOff, blk->spillLen);
+    }
+    blk->rows = rows;
+    blk->epoch = conf.saveEpoch;
+    blk->spilled = 0;
+}
+
+/* blockThaw() for a block whose rows are about to change, which also
+ * queues its byte count for recounting. */
+void blockTouch(int b){
+    rowBlock *blk = &conf.blocks[b];
+    blockThaw(b);
+    blk->edited = 1;
+    conf.byteGen++;
+    if (blk->stale) return;
+
+    blk->stale = 1;
+    if (conf.numStale == conf.staleCap){
+        conf.staleCap = conf.staleCap ? conf.staleCap * 2 : 16;
+        conf.staleBlocks = realloc(conf.staleBlocks, sizeof(int) * conf.staleCap);
+    }
+    conf.staleBlocks[conf.numStale++] = b;
+}
+
+int editorRowShared(editorRow *eRow){
+    return conf.saveJob && eRow->owned && eRow->sharedEpoch == conf.saveEpoch;
+}
+
+editorRow *editorRowAt(int at){
+    if (at < 0 || at >= conf.numRows) return NULL;
+    int off;
+    int b = blockFind(at, &off);
+    __atomic_store_n(&conf.blocks[b].used, 1, __ATOMIC_RELAXED);
+    return &conf.blocks[b].rows[off];
+}
+
+/* editorRowAt() for rows about to be changed. */
+editorRow *editorRowEdit(int at){
+    if (at < 0 || at >= conf.numRows) return NULL;
+    int off;
+    int b = blockFind(at, &off);
+    blockTouch(b);
+    conf.blocks[b].used = 1;
+    editorHlEdit(at, 0);
+    return &conf.blocks[b].rows[off];
+}
+
+/* Makes room for a row at 'at' and returns it uninitialized. */
+editorRow *editorInsertRowSlot(int at){
+    editorHlEdit(at, 1);
+    editorColForget();
+
+    int b, off;
+    if (at == conf.numRows){
+        b = conf.numBlocks - 1;
+        off = b >= 0 ? conf.blocks[b].numRows : 0;
+    } else
+        b = blockFind(at, &off);
+    if (b >= 0) blockTouch(b);
+
+    if (b < 0 || (off == KILO_ROW_BLOCK && b == conf.numBlocks - 1)){
+        blockInsert(++b);
+        off = 0;
+    } else if (conf.blocks[b].numRows == KILO_ROW_BLOCK){
+        rowBlock *full = &conf.blocks[b];
+        int half = KILO_ROW_BLOCK / 2;
+        blockInsert(b + 1);
+        full = &conf.blocks[b];
+        memcpy(conf.blocks[b+1].rows, &full->rows[half], sizeof(editorRow) * half);
+        conf.blocks[b+1].numRows = half;
+        full->numRows = half;
+        blockFenBuild();
+        if (off > half){
+            off -= half;
+            b++;
+        }
+    }
+
+    rowBlock *blk = &conf.blocks[b];
+    memmove(&blk->rows[off+1], &blk->rows[off], sizeof(editorRow) * (blk->numRows - off));
+    blk->numRows++;
+    blockFenAdd(b, 1);
+    conf.numRows++;
+
+    return &blk->rows[off];
+}
+
+/* Makes room for n rows at 'at', uninitialized. Large runs get whole new
+ * blocks spliced in, so the cost does not grow with the rows after 'at'. */
+void editorInsertRowSlots(int at, int n){
+    editorHlEdit(at, n);
+    editorColForget();
+    if (n < KILO_ROW_BLOCK){
+        for (int i = 0; i < n; i++) editorInsertRowSlot(at + i);
+        return;
+    }
+
+    int b = conf.numBlocks, off = 0;
+    if (at < conf.numRows){
+        b = blockFind(at, &off);
+        if (off > 0){
+            blockTouch(b);
+            blockInsert(b + 1);
+            rowBlock *blk = &conf.blocks[b];
+            conf.blocks[b+1].numRows = blk->numRows - off;
+            memcpy(conf.blocks[b+1].rows, &blk->rows[off], sizeof(editorRow) * (blk->numRows - off));
+            blk->numRows = off;
+            b++;
+        }
+    }
+
+    int m = (n + KILO_ROW_BLOCK - 1) / KILO_ROW_BLOCK;
+    if (conf.numBlocks + m > conf.blockCap){
+        while (conf.numBlocks + m > conf.blockCap) conf.blockCap = conf.blockCap ? conf.blockCap * 2 : 16;
+        conf.blocks = realloc(conf.blocks, sizeof(rowBlock) * conf.blockCap);
+        conf.blockFen = realloc(conf.blockFen, sizeof(int) * (conf.blockCap + 1));
+    }
+    memmove(&conf.blocks[b+m], &conf.blocks[b], sizeof(rowBlock) * (conf.numBlocks - b));
+    for (int i = 0; i < m; i++){
+        conf.blocks[b+i].rows = blockAllocRows();
+        conf.blocks[b+i].numRows = n - i * KILO_ROW_BLOCK < KILO_ROW_BLOCK ?
+                                   n - i * KILO_ROW_BLOCK : KILO_ROW_BLOCK;
+        conf.blocks[b+i].epoch = conf.saveEpoch;
+        conf.blocks[b+i].stale = 1;
+        conf.blocks[b+i].used = 1;
+        conf.blocks[b+i].spilled = 0;
+        conf.blocks[b+i].bytes = 0;
+        conf.blocks[b+i].edited = 1;
+    }
+    conf.numBlocks += m;
+    conf.numRows += n;
+    blockFenBuild();
+}
+
+/* Drops the blocks emptied by a bulk delete. */
+void blockCompact(){
+    int k = 0;
+    for (int b = 0; b < conf.numBlocks; b++){
+        if (conf.blocks[b].numRows == 0) blockFreeRows(&conf.blocks[b]);
+        else conf.blocks[k++] = conf.blocks[b];
+    }
+    conf.numBlocks = k;
+    blockFenBuild();
+}
+
+void editorRemoveRowSlot(int at){
+    editorHlEdit(at, -1);
+    editorColForget();
+    int off;
+    int b = blockFind(at, &off);
+    blockTouch(b);
+    rowBlock *blk = &conf.blocks[b];
+
+    memmove(&blk->rows[off], &blk->rows[off+1], sizeof(editorRow) * (blk->numRows - off - 1));
+    blk->numRows--;
+    conf.numRows--;
+    if (blk->numRows == 0)
+        blockRemove(b);
+    else
+        blockFenAdd(b, -1);
+}
+
+/*** line index ***/
+
+/* Byte counts are not kept up to date on every keystroke: blocks whose rows
+ * changed are only recounted, and the tree patched, when an offset is asked
+ * for. Changes to the block list itself rebuild the tree, which costs one
+ * pass over the blocks plus a recount of the stale ones. */
+void byteFenAdd(int b, long long delta){
+    for (b++; b <= conf.numBlocks; b += b & -b)
+        conf.byteFen[b] += delta;
+}
+
+long long byteFenSum(int b){
+    long long sum = 0;
+    for (; b > 0; b -= b & -b)
+        sum += conf.byteFen[b];
+    return sum;
+}
+
+long long blockCountBytes(rowBlock *blk){
+    long long bytes = 0;
+    for (int j = 0; j < blk->numRows; j++) bytes += blk->rows[j].tSize + 1;
+    blk->stale = 0;
+    return bytes;
+}
+
+void byteIndexSync(){
+    if (!conf.byteFenValid){
+        conf.byteFen = realloc(conf.byteFen, sizeof(long long) * (conf.blockCap + 1));
+        for (int b = 1; b <= conf.numBlocks; b++){
+            rowBlock *blk = &conf.blocks[b-1];
+            if (blk->stale) blk->bytes = blockCountBytes(blk);
+            conf.byteFen[b] = blk->bytes;
+        }
+        for (int b = 1; b <= conf.numBlocks; b++){
+            int parent = b + (b & -b);
+            if (parent <= conf.numBlocks) conf.byteFen[parent] += conf.byteFen[b];
+        }
+        conf.byteFenValid = 1;
+    } else {
+        for (int i = 0; i < conf.numStale; i++){
+            rowBlock *blk = &conf.blocks[conf.staleBlocks[i]];
+            long long bytes = blockCountBytes(blk);
+            byteFenAdd(conf.staleBlocks[i], bytes - blk->bytes);
+            blk->bytes = bytes;
+        }
+    }
+    conf.numStale = 0;
+}
+
+/* File offset of row 'at', counting a newline after every row as a save
+ * would write it. */
+long long editorRowOffset(int at){
+    byteIndexSync();
+    if (at >= conf.numRows) return byteFenSum(conf.numBlocks);
+
+    int off;
+    int b = blockFind(at, &off);
+    long long offset = byteFenSum(b);
+    for (int j = 0; j < off; j++) offset += conf.blocks[b].rows[j].tSize + 1;
+    return offset;
+}
+
+/* editorRowOffset() of the cursor row for the status bar, which is painted
+ * every frame: it is only worked out again once the row or the text
+ * changed, as a sync can mean recounting blocks or faulting spilled ones
+ * back in. */
+long long editorStatusOffset(){
+    if (conf.statusRow != conf.cY || conf.statusGen != conf.byteGen){
+        conf.statusOff = editorRowOffset(conf.cY);
+        conf.statusRow = conf.cY;
+        conf.statusGen = conf.byteGen;
+    }
+    return conf.statusOff;
+}
+
+/* The row holding file offset 'offset', and the column of it in *col. */
+int editorOffsetRow(long long offset, int *col){
+    byteIndexSync();
+    *col = 0;
+    if (offset < 0) offset = 0;
+
+    int b = 0;
+    int step = 1;
+    while (step * 2 <= conf.numBlocks) step *= 2;
+
+    for (; step; step /= 2){
+        if (b + step <= conf.numBlocks && conf.byteFen[b + step] <= offset){
+            b += step;
+            offset -= conf.byteFen[b];
+        }
+    }
+    if (b == conf.numBlocks) return conf.numRows;
+
+    int at = blockFenSum(b);
+    rowBlock *blk = &conf.blocks[b];
+    for (int j = 0; j < blk->numRows; j++, at++){
+        if (offset <= blk->rows[j].tSize){
+            *col = offset;
+            break;
+        }
+        offset -= blk->rows[j].tSize + 1;
+    }
+    return at;
+}
+
+/*** utf-8 ***/
+
+/* Row text is taken as UTF-8. A character takes the columns utf8Width()
+ * gives it, and bytes that are not part of a valid sequence are shown as
+ * '?', one column each. Plain ASCII is skipped over a block at a time, so
+ * it costs little more than counting bytes. */
+
+typedef struct utf8Range{
+    int first, last;
+    int width;
+} utf8Range;
+
+/* Code points that do not take one column: combining marks and other
+ * zero width characters, and East Asian wide and fullwidth characters,
+ * emoji included. Sorted, everything else is one column wide. */
+const utf8Range utf8Widths[] = {
+    {0x0300, 0x036f, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05bd, 0}, {0x05bf, 0x05bf, 0},
+    {0x05c1, 0x05c2, 0}, {0x05c4, 0x05c5, 0}, {0x05c7, 0x05c7, 0}, {0x0610, 0x061a, 0},
+    {0x064b, 0x065f, 0}, {0x0670, 0x0670, 0}, {0x06d6, 0x06dc, 0}, {0x06df, 0x06e4, 0},
+    {0x06e7, 0x06e8, 0}, {0x06ea, 0x06ed, 0}, {0x0900, 0x0902, 0}, {0x093a, 0x093a, 0},
+    {0x093c, 0x093c, 0}, {0x0941, 0x0948, 0}, {0x094d, 0x094d, 0}, {0x0951, 0x0957, 0},
+    {0x0962, 0x0963, 0}, {0x0e31, 0x0e31, 0}, {0x0e34, 0x0e3a, 0}, {0x0e47, 0x0e4e, 0},
+    {0x1100, 0x115f, 2}, {0x1ab0, 0x1aff, 0}, {0x1dc0, 0x1dff, 0}, {0x200b, 0x200f, 0},
+    {0x202a, 0x202e, 0}, {0x2060, 0x2064, 0}, {0x20d0, 0x20ff, 0}, {0x231a, 0x231b, 2},
+    {0x2329, 0x232a, 2}, {0x23e9, 0x23ec, 2}, {0x23f0, 0x23f0, 2}, {0x23f3, 0x23f3, 2},
+    {0x25fd, 0x25fe, 2}, {0x2614, 0x2615, 2}, {0x2648, 0x2653, 2}, {0x267f, 0x267f, 2},
+    {0x2693, 0x2693, 2}, {0x26a1, 0x26a1, 2}, {0x26aa, 0x26ab, 2}, {0x26bd, 0x26be, 2},
+    {0x26c4, 0x26c5, 2}, {0x26ce, 0x26ce, 2}, {0x26d4, 0x26d4, 2}, {0x26ea, 0x26ea, 2},
+    {0x26f2, 0x26f3, 2}, {0x26f5, 0x26f5, 2}, {0x26fa, 0x26fa, 2}, {0x26fd, 0x26fd, 2},
+    {0x2705, 0x2705, 2}, {0x270a, 0x270b, 2}, {0x2728, 0x2728, 2}, {0x274c, 0x274c, 2},
+    {0x274e, 0x274e, 2}, {0x2753, 0x2755, 2}, {0x2757, 0x2757, 2}, {0x2795, 0x2797, 2},
+    {0x27b0, 0x27b0, 2}, {0x27bf, 0x27bf, 2}, {0x2b1b, 0x2b1c, 2}, {0x2b50, 0x2b50, 2},
+    {0x2b55, 0x2b55, 2}, {0x2e80, 0x303e, 2}, {0x3041, 0x3096, 2}, {0x3099, 0x309a, 0},
+    {0x309b, 0x33ff, 2}, {0x3400, 0x4dbf, 2}, {0x4e00, 0x9fff, 2}, {0xa000, 0xa4cf, 2},
+    {0xa960, 0xa97f, 2}, {0xac00, 0xd7a3, 2}, {0xf900, 0xfaff, 2}, {0xfe00, 0xfe0f, 0},
+    {0xfe10, 0xfe19, 2}, {0xfe20, 0xfe2f, 0}, {0xfe30, 0xfe6f, 2}, {0xfeff, 0xfeff, 0},
+    {0xff00, 0xff60, 2}, {0xffe0, 0xffe6, 2}, {0x16fe0, 0x16fe4, 2}, {0x17000, 0x18aff, 2},
+    {0x1b000, 0x1b2ff, 2}, {0x1f004, 0x1f004, 2}, {0x1f0cf, 0x1f0cf, 2}, {0x1f18e, 0x1f18e, 2},
+    {0x1f191, 0x1f19a, 2}, {0x1f200, 0x1f202, 2}, {0x1f210, 0x1f23b, 2}, {0x1f240, 0x1f248, 2},
+    {0x1f250, 0x1f251, 2}, {0x1f260, 0x1f265, 2}, {0x1f300, 0x1f320, 2}, {0x1f32d, 0x1f335, 2},
+    {0x1f337, 0x1f37c, 2}, {0x1f37e, 0x1f393, 2}, {0x1f3a0, 0x1f3ca, 2}, {0x1f3cf, 0x1f3d3, 2},
+    {0x1f3e0, 0x1f3f0, 2}, {0x1f3f4, 0x1f3f4, 2}, {0x1f3f8, 0x1f43e, 2}, {0x1f440, 0x1f440, 2},
+    {0x1f442, 0x1f4fc, 2}, {0x1f4ff, 0x1f53d, 2}, {0x1f54b, 0x1f54e, 2}, {0x1f550, 0x1f567, 2},
+    {0x1f57a, 0x1f57a, 2}, {0x1f595, 0x1f596, 2}, {0x1f5a4, 0x1f5a4, 2}, {0x1f5fb, 0x1f64f, 2},
+    {0x1f680, 0x1f6c5, 2}, {0x1f6cc, 0x1f6cc, 2}, {0x1f6d0, 0x1f6d2, 2}, {0x1f6d5, 0x1f6d7, 2},
+    {0x1f6eb, 0x1f6ec, 2}, {0x1f6f4, 0x1f6fc, 2}, {0x1f7e0, 0x1f7eb, 2}, {0x1f90c, 0x1f93a, 2},
+    {0x1f93c, 0x1f945, 2}, {0x1f947, 0x1f9ff, 2}, {0x1fa70, 0x1faff, 2}, {0x20000, 0x2fffd, 2},
+    {0x30000, 0x3fffd, 2}, {0xe0001, 0xe0001, 0}, {0xe0020, 0xe007f, 0}, {0xe0100, 0xe01ef, 0},
+};
+
+#define UTF8_WIDTHS (sizeof(utf8Widths) / sizeof(utf8Widths[0]))
+
+int utf8Width(int cp){
+    if (cp < utf8Widths[0].first) return 1;
+
+    int lo = 0, hi = UTF8_WIDTHS - 1;
+    while (lo <= hi){
+        int mid = (lo + hi) / 2;
+        if (cp < utf8Widths[mid].first) hi = mid - 1;
+        else if (cp > utf8Widths[mid].last) lo = mid + 1;
+        else return utf8Widths[mid].width;
+    }
+    return 1;
+}
+
+/* The length of the valid sequence s starts with, storing its code point,
+ * or 0. Overlong forms, surrogates and C1 controls are not valid. */
+int utf8Decode(const char *s, int n, int *cp){
+    const unsigned char *u = (const unsigned char *)s;
+    int len, c;
+    if (u[0] < 0x80){
+        *cp = u[0];
+        return 1;
+    } else if (u[0] < 0xc2) return 0;
+    else if (u[0] < 0xe0){ len = 2; c = u[0] & 0x1f; }
+    else if (u[0] < 0xf0){ len = 3; c = u[0] & 0x0f; }
+    else if (u[0] < 0xf5){ len = 4; c = u[0] & 0x07; }
+    else return 0;
+
+    if (len > n) return 0;
+    for (int i = 1; i < len; i++){
+        if ((u[i] & 0xc0) != 0x80) return 0;
+        c = (c << 6) | (u[i] & 0x3f);
+    }
+    if ((len == 3 && c < 0x800) || (len == 4 && (c < 0x10000 || c > 0x10ffff)) ||
+        (c >= 0xd800 && c <= 0xdfff) || c < 0xa0)
+        return 0;
+    *cp = c;
+    return len;
+}
+
+/* The length of the character at s[0..n), at least 1, and its width.
+ * Tabs are left to the caller. */
+int utf8Char(const char *s, int n, int *width){
+    int cp;
+    int len = utf8Decode(s, n, &cp);
+    if (len == 0){
+        *width = 1;
+        return 1;
+    }
+    *width = utf8Width(cp);
+    return len;
+}
+
+/* How many bytes s starts with that are ASCII but not tabs, which are the
+ * bytes that take one column each and need no decoding. */
+int utf8Plain(const char *s, int n){
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i tab = _mm_set1_epi8('\t');
+    for (; i + 16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < n && (unsigned char)s[i] < 0x80 && s[i] != '\t') i++;
+    return i;
+}
+
+/* 'i', or if it falls inside a character, the end of that character. */
+int utf8Skip(const char *s, int i, int n){
+    if (i >= n || ((unsigned char)s[i] & 0xc0) != 0x80) return i;
+    for (int j = i - 1; j >= 0 && j >= i - 3; j--){
+        if (((unsigned char)s[j] & 0xc0) == 0x80) continue;
+        int cp;
+        int len = utf8Decode(&s[j], n - j, &cp);
+        return j + len > i ? j + len : i;
+    }
+    return i;
+}
+
+/* Where the character before s[i] starts. */
+int utf8Prev(const char *s, int i, int n){
+    if (i <= 0) return 0;
+    for (int j = i - 1; j >= 0 && j >= i - 4; j--){
+        if (((unsigned char)s[j] & 0xc0) == 0x80) continue;
+        int cp;
+        return j + utf8Decode(&s[j], n - j, &cp) == i ? j : i - 1;
+    }
+    return i - 1;
+}
+
+/*** row operations ***/
+
+/* Rows longer than KILO_LONG_LINE keep a column index, so finding the render
+ * column of a byte does not walk the row from its start: cols[k] is the
+ * column byte k * KILO_COL_STEP starts at. It is worked out lazily, only as
+ * far as a lookup needs, and an edit cuts it back to the edited byte rather
+ * than dropping it. A few rows have one at a time; since they are found by
+ * address, rows moving or being freed forget them all. */
+typedef struct colIndex{
+    editorRow *row;
+    unsigned int gen;           // row gen the index is good for
+    int *cols;
+    int numCols, cap;           // entries worked out, and allocated
+} colIndex;
+
+struct colState{
+    colIndex slot[KILO_COL_SLOTS];
+    int next;                   // slot to reuse next
+} cols;
+
+void editorColForget(){
+    for (int i = 0; i < KILO_COL_SLOTS; i++) cols.slot[i].row = NULL;
+}
+
+/* The render column byte 'to' of the row starts at, when byte 'from'
+ * starts at rx. A character's columns are counted at its first byte, so
+ * either may fall inside one. */
+int editorColAdvance(editorRow *eRow, int from, int to, int rx){
+    const char *text = eRow->text;
+    from = utf8Skip(text, from, eRow->tSize);
+    while (from < to){
+        int plain = utf8Plain(&text[from], to - from);
+        rx += plain;
+        from += plain;
+        if (from == to) break;
+
+        if (text[from] == '\t'){
+            rx += KILO_TAB_STOP - rx % KILO_TAB_STOP;
+            from++;
+        } else {
+            int width;
+            from += utf8Char(&text[from], eRow->tSize - from, &width);
+            rx += width;
+        }
+    }
+    return rx;
+}
+
+/* The row's column index, worked out at least up to entry k. */
+colIndex *editorColIndex(editorRow *eRow, int k){
+    colIndex *ci = NULL;
+    for (int i = 0; i < KILO_COL_SLOTS; i++)
+        if (cols.slot[i].row == eRow) ci = &cols.slot[i];
+    if (ci == NULL){
+        ci = &cols.slot[cols.next];
+        cols.next = (cols.next + 1) % KILO_COL_SLOTS;
+        ci->row = eRow;
+        ci->numCols = 0;
+    }
+    if (ci->gen != eRow->gen || ci->numCols == 0){
+        if (ci->cols == NULL){
+            ci->cap = 64;
+            ci->cols = malloc(sizeof(int) * ci->cap);
+        }
+        ci->gen = eRow->gen;
+        ci->cols[0] = 0;
+        ci->numCols = 1;
+    }
+
+    int last = eRow->tSize / KILO_COL_STEP;
+    if (k > last) k = last;
+    if (k >= ci->cap){
+        while (k >= ci->cap) ci->cap *= 2;
+        ci->cols = realloc(ci->cols, sizeof(int) * ci->cap);
+    }
+    for (int n = ci->numCols; n <= k; n++)
+        ci->cols[n] = editorColAdvance(eRow, (n - 1) * KILO_COL_STEP,
+                                       n * KILO_COL_STEP, ci->cols[n-1]);
+    if (ci->numCols <= k) ci->numCols = k + 1;
+    return ci;
+}
+
+int editorRowCxToRx(editorRow *erow, int cX){
+    if (cX > erow->tSize) cX = erow->tSize;
+    if (erow->tSize <= KILO_LONG_LINE)
+        return editorColAdvance(erow, 0, cX, 0);
+
+    int k = cX / KILO_COL_STEP;
+    colIndex *ci = editorColIndex(erow, k);
+    return editorColAdvance(erow, k * KILO_COL_STEP, cX, ci->cols[k]);
+}
+
+int editorRowRxToCx(editorRow *eRow, int rx) {
+  int cur_rX = 0;
+  int cX = 0;
+  if (eRow->tSize > KILO_LONG_LINE){
+    /* Work the index out until it passes rx, then find the last entry
+     * at or before it. */
+    colIndex *ci = editorColIndex(eRow, 0);
+    int last = eRow->tSize / KILO_COL_STEP;
+    while (ci->numCols - 1 < last && ci->cols[ci->numCols-1] <= rx)
+      ci = editorColIndex(eRow, ci->numCols);
+
+    int lo = 0, hi = ci->numCols - 1;
+    while (lo < hi){
+      int mid = (lo + hi + 1) / 2;
+      if (ci->cols[mid] <= rx) lo = mid;
+      else hi = mid - 1;
+    }
+    cur_rX = ci->cols[lo];
+    cX = utf8Skip(eRow->text, lo * KILO_COL_STEP, eRow->tSize);
+  }
+
+  while (cX < eRow->tSize) {
+    int width = 1, len = 1;
+    if (eRow->text[cX] == '\t')
+      width = KILO_TAB_STOP - cur_rX % KILO_TAB_STOP;
+    else if ((unsigned char)eRow->text[cX] >= 0x80)
+      len = utf8Char(&eRow->text[cX], eRow->tSize - cX, &width);
+    cur_rX += width;
+    if (cur_rX > rx) return cX;
+    cX += len;
+  }
+  return cX;
+}
+
+void editorRowFreeRender(editorRow *eRow){
+    slabFree(eRow->render, eRow->rCap);
+    conf.renderBytes -= eRow->rCap;
+    eRow->render = NULL;
+    eRow->rSize = 0;
+    eRow->rCap = 0;
+}
+
+/* Rows with multi-byte characters get no render: they are drawn from
+ * their text, see editorDrawText(). */
+void editorUpdateRow(editorRow *erow){
+    int tabs = 0;
+    erow->utf8 = 0;
+    for (int j = 0; j < erow->tSize; j++){
+        j += utf8Plain(&erow->text[j], erow->tSize - j);
+        if (j == erow->tSize) break;
+        if (erow->text[j] == '\t') tabs++;
+        else erow->utf8 = 1;
+    }
+
+    if (erow->utf8){
+        if (erow->render) editorRowFreeRender(erow);
+        erow->renderGen = erow->gen;
+        return;
+    }
+
+    int need = erow->tSize + tabs*(KILO_TAB_STOP-1) + 1;
+    if (erow->render == NULL || need > erow->rCap){
+        int cap = erow->rCap;
+        erow->render = slabGrow(erow->render, &cap, 0, need);
+        conf.renderBytes += cap - erow->rCap;
+        erow->rCap = cap;
+    }
+
+    int idx = 0;
+    for (int j = 0; j < erow->tSize; j++){
+        int plain = utf8Plain(&erow->text[j], erow->tSize - j);
+        memcpy(&erow->render[idx], &erow->text[j], plain);
+        idx += plain;
+        j += plain;
+        if (j == erow->tSize) break;
+
+        erow->render[idx++] = ' ';
+        while (idx % KILO_TAB_STOP != 0) erow->render[idx++] = ' ';
+    }
+
+    erow->render[idx] = '\0';
+    erow->rSize = idx;
+    erow->renderGen = erow->gen;
+}
+
+/* Renders are rebuilt lazily from the text, so dropping one only costs a
+ * rebuild if the row is looked at again. A clock sweep over the rows frees
+ * renders that have not been used since the hand last passed, skipping the
+ * rows on screen, until the total is back under three quarters of the cap. */
+void editorEvictRenders(editorRow *keep){
+    size_t target = KILO_RENDER_CAP / 4 * 3;
+    int swept = 0;
+
+    while (conf.renderBytes > target && swept < 2 * conf.numRows){
+        if (conf.evictHand >= conf.numRows) conf.evictHand = 0;
+
+        int off;
+        int b = blockFind(conf.evictHand, &off);
+        rowBlock *blk = &conf.blocks[b];
+        for (; off < blk->numRows && conf.renderBytes > target; off++, swept++){
+            int at = conf.evictHand++;
+            editorRow *eRow = &blk->rows[off];
+            if (eRow->render == NULL || eRow == keep) continue;
+            if (at >= conf.rowOff && at < conf.rowOff + conf.screenRows) continue;
+
+            if (eRow->renderRef) eRow->renderRef = 0;
+            else editorRowFreeRender(eRow);
+        }
+    }
+}
+
+/* A nul-terminated slab copy of s. */
+char *editorNewText(const char *s, size_t len, int *cap){
+    char *text = slabAlloc(len + 1, cap);
+    memcpy(text, s, len);
+    text[len] = '\0';
+    return text;
+}
+
+/* Rows loaded through editorOpenMapped() borrow their text from conf.map and
+ * have no render until they are drawn. Anything that writes to a row's text
+ * has to call editorRowOwn() first. */
+void editorRowOwn(editorRow *eRow){
+    if (eRow->owned && !editorRowShared(eRow)) return;
+
+    int cap;
+    char *text = editorNewText(eRow->text, eRow->tSize, &cap);
+    if (eRow->owned) editorGraveAdd(eRow->text, eRow->tCap);
+    eRow->text = text;
+    eRow->tCap = cap;
+    eRow->owned = 1;
+    eRow->sharedEpoch = 0;
+}
+
+/* Called after every change to a row's text from byte 'at' on. The render
+ * is left stale and only rebuilt when someone asks for it through
+ * editorRowRender(); a column index keeps the entries before 'at'. */
+void editorRowChanged(editorRow *eRow, int at){
+    for (int i = 0; i < KILO_COL_SLOTS; i++){
+        colIndex *ci = &cols.slot[i];
+        if (ci->row != eRow || ci->gen != eRow->gen) continue;
+        ci->gen = eRow->gen + 1;
+        if (ci->numCols > at / KILO_COL_STEP + 1) ci->numCols = at / KILO_COL_STEP + 1;
+    }
+    eRow->gen++;
+}
+
+char *editorRowRender(editorRow *eRow){
+    eRow->renderRef = 1;
+    if ((eRow->render != NULL || eRow->utf8) && eRow->renderGen == eRow->gen)
+        return eRow->render;
+
+    long long start = perfBegin();
+    editorUpdateRow(eRow);
+    perfEnd(PERF_ROW, start);
+    if (conf.renderBytes > KILO_RENDER_CAP) editorEvictRenders(eRow);
+    return eRow->render;
+}
+
+/* 'cap' is the slab capacity of text, or 0 for text borrowed from conf.map. */
+void editorRowInit(editorRow *eRow, char *text, int len, int cap){
+    eRow->text = text;
+    eRow->tSize = len;
+    eRow->tCap = cap;
+    eRow->owned = cap != 0;
+    eRow->render = NULL;
+    eRow->rSize = 0;
+    eRow->rCap = 0;
+    eRow->gen = 0;
+    eRow->renderGen = 0;
+    eRow->renderRef = 0;
+    eRow->hlState = 0;
+    eRow->utf8 = 0;
+    eRow->sharedEpoch = 0;
+}
+
+
+void editorInsertRow(int at, char *s, size_t len){
+    if (at < 0 || at > conf.numRows) return;
+
+    int cap;
+    char *text = editorNewText(s, len, &cap);
+    editorRowInit(editorInsertRowSlot(at), text, len, cap);
+    
+    conf.dirty++;
+}
+
+void editorFreeRow(editorRow *eRow){
+    editorColForget();
+    if (editorRowShared(eRow)) editorGraveAdd(eRow->text, eRow->tCap);
+    else if (eRow->owned) slabFree(eRow->text, eRow->tCap);
+    editorRowFreeRender(eRow);
+}
+
+void editorDelRow(int at){
+    if (at < 0 || at >= conf.numRows) return;
+    editorFreeRow(editorRowEdit(at));
+    editorRemoveRowSlot(at);
+    conf.dirty++;
+}
+
+/* Deletes n rows from 'at' a block at a time. */
+void editorDelRows(int at, int n){
+    if (at < 0 || n <= 0 || at + n > conf.numRows) return;
+    editorHlEdit(at, -n);
+    editorColForget();
+
+    while (n > 0){
+        int off;
+        int b = blockFind(at, &off);
+        blockTouch(b);
+        rowBlock *blk = &conf.blocks[b];
+
+        int k = blk->numRows - off < n ? blk->numRows - off : n;
+        for (int j = off; j < off + k; j++) editorFreeRow(&blk->rows[j]);
+        memmove(&blk->rows[off], &blk->rows[off+k], sizeof(editorRow) * (blk->numRows - off - k));
+        blk->numRows -= k;
+        blockFenAdd(b, -k);
+        conf.numRows -= k;
+        n -= k;
+    }
+
+    blockCompact();
+    conf.dirty++;
+}
+
+void editorRowInsertChar(editorRow *erow, int at, int c){
+    if (at < 0 || at > erow->tSize) at = erow->tSize;
+    editorRowOwn(erow);
+    erow->text = slabGrow(erow->text, &erow->tCap, erow->tSize + 1, erow->tSize + 2);
+    memmove(&erow->text[at+1], &erow->text[at], erow->tSize - at + 1);
+    erow->tSize++;
+    erow->text[at] = c;
+    editorRowChanged(erow, at);
+    conf.dirty++;
+}
+
+void editorRowAppendString(editorRow *eRow, char *s, size_t len){
+    editorRowOwn(eRow);
+    eRow->text = slabGrow(eRow->text, &eRow->tCap, eRow->tSize, eRow->tSize + len + 1);
+    memcpy(&eRow->text[eRow->tSize], s, len);
+    eRow->tSize += len;
+    eRow->text[eRow->tSize] = '\0';
+    editorRowChanged(eRow, eRow->tSize - len);
+    conf.dirty++;
+}
+
+void editorRowDelChar(editorRow *eRow, int at){
+    if (at < 0 || at >= eRow->tSize) return;
+    editorRowOwn(eRow);
+    memmove(&eRow->text[at], &eRow->text[at+1], eRow->tSize - at);
+    eRow->tSize--;
+    editorRowChanged(eRow, at);
+    conf.dirty++;
+}
+
+/*** syntax highlighting ***/
+
+/* The highlighter runs over a row's text from the state the previous row
+ * ended in, which is all it carries from line to line (whether a block
+ * comment is open). Each row keeps its end state. conf.hlValid counts the
+ * rows from the top whose state is known good; an edit pulls it back to the
+ * edited row. Rows between there and conf.hlTail are unchanged, so once the
+ * rescan from the edit produces the end state a row had before, they are
+ * all good again. States are only brought up to date as far as the screen
+ * needs, and colors are only worked out for the rows being drawn. */
+
+#define HL_NUMBERS (1<<0)
+#define HL_STRINGS (1<<1)
+#define HL_KEYS (1<<2)          // strings followed by ':' are keys (JSON)
+#define HL_TIMES (1<<3)         // numbers may contain ':' and '-' (logs)
+
+enum hlState{
+    HLS_NORMAL = 0,
+    HLS_COMMENT
+};
+
+typedef struct hlKeyword{
+    const char *word;
+    unsigned char attr;
+} hlKeyword;
+
+typedef struct editorSyntax{
+    const char *fileType;
+    const char **fileMatch;
+    const hlKeyword *keywords;
+    const char *comment;
+    const char *commentStart, *commentEnd;
+    const char *quotes;
+    int flags;
+    unsigned char special[256];     // bytes that can open a comment or string
+} editorSyntax;
+
+const char *cFileMatch[] = {".c", ".h", ".cc", ".cpp", ".hpp", NULL};
+const hlKeyword cKeywords[] = {
+    {"switch", ATTR_KEYWORD1}, {"if", ATTR_KEYWORD1}, {"while", ATTR_KEYWORD1},
+    {"for", ATTR_KEYWORD1}, {"break", ATTR_KEYWORD1}, {"continue", ATTR_KEYWORD1},
+    {"return", ATTR_KEYWORD1}, {"else", ATTR_KEYWORD1}, {"struct", ATTR_KEYWORD1},
+    {"union", ATTR_KEYWORD1}, {"typedef", ATTR_KEYWORD1}, {"static", ATTR_KEYWORD1},
+    {"enum", ATTR_KEYWORD1}, {"case", ATTR_KEYWORD1}, {"default", ATTR_KEYWORD1},
+    {"do", ATTR_KEYWORD1}, {"goto", ATTR_KEYWORD1}, {"sizeof", ATTR_KEYWORD1},
+    {"const", ATTR_KEYWORD1}, {"extern", ATTR_KEYWORD1}, {"volatile", ATTR_KEYWORD1},
+    {"#include", ATTR_KEYWORD1}, {"#define", ATTR_KEYWORD1}, {"#if", ATTR_KEYWORD1},
+    {"#ifdef", ATTR_KEYWORD1}, {"#ifndef", ATTR_KEYWORD1}, {"#endif", ATTR_KEYWORD1},
+    {"#else", ATTR_KEYWORD1},
+    {"int", ATTR_KEYWORD2}, {"long", ATTR_KEYWORD2}, {"double", ATTR_KEYWORD2},
+    {"float", ATTR_KEYWORD2}, {"char", ATTR_KEYWORD2}, {"unsigned", ATTR_KEYWORD2},
+    {"signed", ATTR_KEYWORD2}, {"void", ATTR_KEYWORD2}, {"short", ATTR_KEYWORD2},
+    {"size_t", ATTR_KEYWORD2},
+    {NULL, 0}
+};
+
+const char *jsonFileMatch[] = {".json", NULL};
+const hlKeyword jsonKeywords[] = {
+    {"true", ATTR_KEYWORD1}, {"false", ATTR_KEYWORD1}, {"null", ATTR_KEYWORD1},
+    {NULL, 0}
+};
+
+const char *logFileMatch[] = {".log", NULL};
+const hlKeyword logKeywords[] = {
+    {"FATAL", ATTR_ERROR}, {"CRITICAL", ATTR_ERROR}, {"ERROR", ATTR_ERROR},
+    {"error", ATTR_ERROR}, {"WARNING", ATTR_WARNING}, {"WARN", ATTR_WARNING},
+    {"warning", ATTR_WARNING}, {"INFO", ATTR_KEYWORD2}, {"DEBUG", ATTR_KEYWORD2},
+    {"TRACE", ATTR_KEYWORD2},
+    {NULL, 0}
+};
+
+editorSyntax HLDB[] = {
+    {"c", cFileMatch, cKeywords, "//", "/*", "*/", "\"'", HL_NUMBERS | HL_STRINGS, {0}},
+    {"json", jsonFileMatch, jsonKeywords, NULL, NULL, NULL, "\"", HL_NUMBERS | HL_STRINGS | HL_KEYS, {0}},
+    {"log", logFileMatch, logKeywords, NULL, NULL, NULL, "\"", HL_NUMBERS | HL_STRINGS | HL_TIMES, {0}},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+/* An edit to row 'at', or 'delta' rows inserted (or removed, if negative)
+ * there. */
+void editorHlEdit(int at, int delta){
+    if (delta == 0 && at < conf.hlValid){
+        conf.hlTail = conf.hlValid;
+        conf.hlValid = at;
+    } else if (delta != 0 || at > conf.hlValid){
+        if (conf.hlTail > at) conf.hlTail = at;
+        if (conf.hlValid > at) conf.hlValid = at;
+    }
+}
+
+void editorSelectSyntax(){
+    conf.syntax = NULL;
+    conf.hlValid = 0;
+    conf.hlTail = 0;
+    if (conf.filename == NULL) return;
+
+    char *ext = strrchr(conf.filename, '.');
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++){
+        for (int i = 0; HLDB[j].fileMatch[i]; i++){
+            if (ext && strcmp(ext, HLDB[j].fileMatch[i]) == 0){
+                editorSyntax *syn = conf.syntax = &HLDB[j];
+                if (syn->comment) syn->special[(unsigned char)syn->comment[0]] = 1;
+                if (syn->commentStart) syn->special[(unsigned char)syn->commentStart[0]] = 1;
+                for (const char *q = syn->quotes; *q; q++) syn->special[(unsigned char)*q] = 1;
+                return;
+            }
+        }
+    }
+}
+
+int isSeparator(int c){
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:", c) != NULL;
+}
+
+int hlStartsWith(const char *text, int i, int n, const char *s){
+    int len = strlen(s);
+    return i + len <= n && memcmp(&text[i], s, len) == 0;
+}
+
+/* Highlights the row's text starting in 'state', one attr per byte into hl,
+ * and returns the state it ends in. */
+int editorHlLine(editorRow *eRow, int state, unsigned char *hl){
+    editorSyntax *syn = conf.syntax;
+    const char *text = eRow->text;
+    int n = eRow->tSize;
+
+    int inComment = state == HLS_COMMENT;
+    int inString = 0, stringStart = 0;
+    int prevSep = 1, prevAttr = ATTR_NORMAL;
+    int i = 0;
+
+#define HL_MARK(from, count, a) do { memset(&hl[from], (a), (count)); prevAttr = (a); } while (0)
+
+    while (i < n){
+        char c = text[i];
+
+        if (syn->comment && !inString && !inComment && hlStartsWith(text, i, n, syn->comment)){
+            HL_MARK(i, n - i, ATTR_COMMENT);
+            break;
+        }
+
+        if (syn->commentStart && !inString){
+            if (inComment){
+                if (hlStartsWith(text, i, n, syn->commentEnd)){
+                    int len = strlen(syn->commentEnd);
+                    HL_MARK(i, len, ATTR_COMMENT);
+                    i += len;
+                    inComment = 0;
+                    prevSep = 1;
+                } else {
+                    HL_MARK(i, 1, ATTR_COMMENT);
+                    i++;
+                }
+                continue;
+            } else if (hlStartsWith(text, i, n, syn->commentStart)){
+                int len = strlen(syn->commentStart);
+                HL_MARK(i, len, ATTR_COMMENT);
+                i += len;
+                inComment = 1;
+                continue;
+            }
+        }
+
+        if (syn->flags & HL_STRINGS){
+            if (inString){
+                HL_MARK(i, 1, ATTR_STRING);
+                if (c == '\\' && i + 1 < n){
+                    HL_MARK(i + 1, 1, ATTR_STRING);
+                    i += 2;
+                    continue;
+                }
+                i++;
+                if (c == inString){
+                    inString = 0;
+                    prevSep = 1;
+                    if (syn->flags & HL_KEYS){
+                        int j = i;
+                        while (j < n && isspace((unsigned char)text[j])) j++;
+                        if (j < n && text[j] == ':') memset(&hl[stringStart], ATTR_KEYWORD2, i - stringStart);
+                    }
+                }
+                continue;
+            } else if (strchr(syn->quotes, c) && c != '\0'){
+                inString = c;
+                stringStart = i;
+                HL_MARK(i, 1, ATTR_STRING);
+                i++;
+                continue;
+            }
+        }
+
+        if (syn->flags & HL_NUMBERS){
+            int more = prevAttr == ATTR_NUMBER && (c == '.' ||
+                       ((syn->flags & HL_TIMES) && (c == ':' || c == '-')));
+            if ((isdigit((unsigned char)c) && (prevSep || prevAttr == ATTR_NUMBER)) || more){
+                HL_MARK(i, 1, ATTR_NUMBER);
+                i++;
+                prevSep = 0;
+                continue;
+            }
+        }
+
+        if (prevSep){
+            const hlKeyword *kw = syn->keywords;
+            for (; kw->word; kw++){
+                if (kw->word[0] != c) continue;
+                int len = strlen(kw->word);
+                if (hlStartsWith(text, i, n, kw->word) &&
+                    (i + len == n || isSeparator((unsigned char)text[i + len])))
+                    break;
+            }
+            if (kw->word){
+                int len = strlen(kw->word);
+                HL_MARK(i, len, kw->attr);
+                i += len;
+                prevSep = 0;
+                continue;
+            }
+        }
+
+        HL_MARK(i, 1, ATTR_NORMAL);
+        prevSep = isSeparator((unsigned char)c);
+        i++;
+    }
+
+#undef HL_MARK
+
+    return inComment ? HLS_COMMENT : HLS_NORMAL;
+}
+
+/* The state editorHlLine() would end the row in. Only comments and strings
+ * matter for that, so the bytes that cannot start one are skipped. */
+int editorHlState(editorRow *eRow, int state){
+    editorSyntax *syn = conf.syntax;
+    const char *text = eRow->text;
+    int n = eRow->tSize;
+    int i = 0;
+
+    /* Long rows are drawn without colors and left out of the scan. */
+    if (n > KILO_LONG_LINE) return state;
+
+    while (i < n){
+        if (state == HLS_COMMENT){
+            int len = strlen(syn->commentEnd);
+            char *end = memmem(&text[i], n - i, syn->commentEnd, len);
+            if (end == NULL) return HLS_COMMENT;
+            i = end - text + len;
+            state = HLS_NORMAL;
+            continue;
+        }
+
+        while (i < n && !syn->special[(unsigned char)text[i]]) i++;
+        if (i == n) break;
+
+        if (syn->comment && hlStartsWith(text, i, n, syn->comment)) break;
+        if (syn->commentStart && hlStartsWith(text, i, n, syn->commentStart)){
+            i += strlen(syn->commentStart);
+            state = HLS_COMMENT;
+        } else if ((syn->flags & HL_STRINGS) && strchr(syn->quotes, text[i])){
+            char quote = text[i++];
+            while (i < n){
+                if (text[i] == '\\') i += 2;
+                else if (text[i++] == quote) break;
+            }
+        } else
+            i++;
+    }
+
+    return state;
+}
+
+/* Brings the end states of the first 'upTo' rows up to date. */
+void editorHlUpdate(int upTo){
+    if (conf.syntax == NULL) return;
+    if (upTo > conf.numRows) upTo = conf.numRows;
+    if (conf.hlValid >= upTo) return;
+
+    long long start = perfBegin();
+    for (int blocks = 1; conf.hlValid < upTo; blocks++){
+        if (blocks % 64 == 0) editorMemTrim(0);
+        int at = conf.hlValid, off;
+        int state = at ? editorRowAt(at - 1)->hlState : HLS_NORMAL;
+        rowBlock *blk = &conf.blocks[blockFind(at, &off)];
+
+        for (; off < blk->numRows && conf.hlValid < upTo; off++){
+            editorRow *eRow = &blk->rows[off];
+            int old = eRow->hlState;
+            state = editorHlState(eRow, state);
+            eRow->hlState = state;
+            conf.hlValid++;
+
+            if (state == old && conf.hlValid < conf.hlTail){
+                conf.hlValid = conf.hlTail;
+                break;
+            }
+        }
+    }
+    perfEnd(PERF_HL, start);
+}
+
+/* Colors for each byte of the row's text, in a scratch buffer that lasts
+ * until the next call. The rows above must be up to date. */
+unsigned char *editorHlText(int at){
+    editorRow *eRow = editorRowAt(at);
+
+    long long start = perfBegin();
+    if (eRow->tSize > conf.hlTextCap){
+        conf.hlTextCap = eRow->tSize * 2;
+        conf.hlText = realloc(conf.hlText, conf.hlTextCap);
+    }
+    editorHlLine(eRow, at ? editorRowAt(at - 1)->hlState : HLS_NORMAL, conf.hlText);
+    perfEnd(PERF_HL, start);
+
+    return conf.hlText;
+}
+
+/* Colors for each column of the row's render, which it must have; see
+ * editorHlText(). */
+unsigned char *editorHlRender(int at){
+    editorRow *eRow = editorRowAt(at);
+    char *render = editorRowRender(eRow);
+    (void)render;
+
+    editorHlText(at);
+    long long start = perfBegin();
+    if (eRow->rSize > conf.hlRenderCap){
+        conf.hlRenderCap = eRow->rSize * 2;
+        conf.hlRender = realloc(conf.hlRender, conf.hlRenderCap);
+    }
+
+    int col = 0;
+    for (int j = 0; j < eRow->tSize; j++){
+        conf.hlRender[col++] = conf.hlText[j];
+        if (eRow->text[j] == '\t')
+            while (col % KILO_TAB_STOP != 0) conf.hlRender[col++] = conf.hlText[j];
+    }
+    perfEnd(PERF_HL, start);
+
+    return conf.hlRender;
+}
+
+/*** undo ***/
+
+/* Every edit is logged as the text it inserted or deleted and where. Records
+ * are bump-allocated back to back in KILO_UNDO_CHUNK sized chunks, and a
+ * run of typed characters grows the last record in place. Records sharing
+ * a group are undone together. Once the chunks go over KILO_UNDO_LIMIT the
+ * oldest are dropped whole. */
+
+enum undoType{
+    UNDO_INSERT,
+    UNDO_DELETE
+};
+
+enum undoKind{
+    UNDO_OTHER = 0,
+    UNDO_TYPING,
+    UNDO_DELETING
+};
+
+typedef struct undoRec{
+    int prev;               // offset of the previous record in the chunk, or -1
+    int size;               // bytes the record takes in the chunk
+    unsigned int group;
+    unsigned char type;
+    unsigned char addRow;   // the edit first appended an empty row at 'row'
+    int row, col;           // where the text went in or came out
+    int cY, cX;             // cursor before the edit
+    int len;
+    char text[];            // lines separated by '\n'
+} undoRec;
+
+typedef struct undoChunk{
+    struct undoChunk *prev, *next;
+    size_t used, cap;
+    long last;              // offset of the last record
+} undoChunk;
+
+struct undoState{
+    undoChunk *head, *tail;
+    undoChunk *top;         // chunk holding the last record applied, or NULL
+    long topOff;
+    size_t bytes;
+    unsigned int group;
+    int kind;               // what the last record was for, to merge with
+    int replay;             // applying history, so don't record it
+} undoState;
+
+undoRec *undoAt(undoChunk *c, long off){
+    return (undoRec *)((char *)(c + 1) + off);
+}
+
+undoRec *undoTop(){
+    return undoState.top ? undoAt(undoState.top, undoState.topOff) : NULL;
+}
+
+void undoFreeFrom(undoChunk *c){
+    if (c && c->prev) c->prev->next = NULL;
+    while (c){
+        undoChunk *next = c->next;
+        undoState.bytes -= c->cap;
+        if (c == undoState.head) undoState.head = NULL;
+        free(c);
+        c = next;
+    }
+}
+
+/* Drops the records that could be redone. */
+void undoTruncate(){
+    undoChunk *top = undoState.top;
+    if (top == NULL){
+        undoFreeFrom(undoState.head);
+        undoState.tail = NULL;
+        return;
+    }
+
+    top->used = undoState.topOff + undoAt(top, undoState.topOff)->size;
+    top->last = undoState.topOff;
+    undoFreeFrom(top->next);
+    undoState.tail = top;
+}
+
+/* Closes the current group so the next edit starts a new one. */
+void editorUndoBreak(){
+    undoState.kind = UNDO_OTHER;
+}
+
+/* Logs an edit and returns where its 'len' bytes of text go, or NULL when
+ * nothing is being recorded. With 'join' set the record is undone together
+ * with the one before it. */
+char *editorUndoPush(int type, int kind, int join, int row, int col, size_t len, int addRow){
+    if (undoState.replay) return NULL;
+    undoTruncate();
+
+    size_t size = (sizeof(undoRec) + len + 7) & ~(size_t)7;
+    if (size > KILO_UNDO_LIMIT){
+        undoFreeFrom(undoState.head);
+        undoState.tail = undoState.top = NULL;
+        undoState.kind = UNDO_OTHER;
+        editorSetStatusMessage("Edit too large to undo, history cleared");
+        return NULL;
+    }
+
+    undoChunk *c = undoState.tail;
+    if (c == NULL || c->cap - c->used < size){
+        size_t cap = size > KILO_UNDO_CHUNK ? size : KILO_UNDO_CHUNK;
+        undoChunk *n = malloc(sizeof(undoChunk) + cap);
+        n->prev = c;
+        n->next = NULL;
+        n->used = 0;
+        n->cap = cap;
+        n->last = -1;
+        if (c) c->next = n;
+        else undoState.head = n;
+        undoState.tail = c = n;
+        undoState.bytes += cap;
+    }
+
+    undoRec *rec = undoAt(c, c->used);
+    rec->prev = c->last;
+    rec->size = size;
+    if (!join || kind != undoState.kind) undoState.group++;
+    rec->group = undoState.group;
+    rec->type = type;
+    rec->addRow = addRow;
+    rec->row = row;
+    rec->col = col;
+    rec->cY = conf.cY;
+    rec->cX = conf.cX;
+    rec->len = len;
+
+    undoState.top = c;
+    undoState.topOff = c->used;
+    c->last = c->used;
+    c->used += size;
+    undoState.kind = kind;
+
+    while (undoState.bytes > KILO_UNDO_LIMIT && undoState.head != undoState.tail){
+        undoChunk *old = undoState.head;
+        undoState.head = old->next;
+        undoState.head->prev = NULL;
+        undoState.bytes -= old->cap;
+        free(old);
+    }
+
+    return rec->text;
+}
+
+/* Appends a typed character to the record of the characters typed just
+ * before it, if there is one with room to grow. */
+int editorUndoExtend(int row, int col, char ch){
+    undoRec *rec = undoTop();
+    undoChunk *c = undoState.top;
+    if (undoState.replay || rec == NULL || undoState.kind != UNDO_TYPING) return 0;
+    if (c != undoState.tail || undoState.topOff + rec->size != (long)c->used) return 0;
+    if (rec->row != row || rec->col + rec->len != col) return 0;
+
+    size_t size = (sizeof(undoRec) + rec->len + 1 + 7) & ~(size_t)7;
+    if (undoState.topOff + size > c->cap) return 0;
+
+    rec->text[rec->len++] = ch;
+    rec->size = size;
+    c->used = undoState.topOff + size;
+    return 1;
+}
+
+/* True if deleting [row:col, endRow:endCol) continues the deletes before
+ * it, as repeated backspace or delete does. */
+int editorUndoJoins(int row, int col, int endRow, int endCol){
+    undoRec *rec = undoTop();
+    if (rec == NULL || undoState.kind != UNDO_DELETING || rec->type != UNDO_DELETE) return 0;
+    return (rec->row == endRow && rec->col == endCol) || (rec->row == row && rec->col == col);
+}
+
+void editorUndoApply(undoRec *rec, int redo){
+    if ((rec->type == UNDO_INSERT) == redo){
+        if (rec->addRow){
+            editorJournal(JOURNAL_INSERT, rec->row, 0, 0, 0, "", 0);
+            editorInsertRow(rec->row, "", 0);
+        }
+        conf.cY = rec->row;
+        conf.cX = rec->col;
+        if (rec->len) editorInsertText(rec->text, rec->len);
+        return;
+    }
+
+    int endRow = rec->row, endCol = rec->col;
+    for (int i = 0; i < rec->len; i++){
+        if (rec->text[i] == '\n'){
+            endRow++;
+            endCol = 0;
+        } else
+            endCol++;
+    }
+    if (rec->len) editorDelRange(rec->row, rec->col, endRow, endCol);
+    if (rec->addRow){
+        editorJournal(JOURNAL_DELROW, rec->row, 0, 0, 0, "", 0);
+        editorDelRow(rec->row);
+    }
+    conf.cY = rec->row;
+    conf.cX = rec->col;
+}
+
+void editorUndo(){
+    undoRec *rec = undoTop();
+    if (rec == NULL){
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+
+    unsigned int group = rec->group;
+    undoState.replay = 1;
+    while (rec && rec->group == group){
+        editorUndoApply(rec, 0);
+        conf.cY = rec->cY;
+        conf.cX = rec->cX;
+
+        if (rec->prev == -1){
+            undoState.top = undoState.top->prev;
+            undoState.topOff = undoState.top ? undoState.top->last : -1;
+        } else
+            undoState.topOff = rec->prev;
+        rec = undoTop();
+    }
+    undoState.replay = 0;
+    editorUndoBreak();
+}
+
+/* The record after the last one applied, or NULL. */
+undoRec *undoNext(undoChunk **c, long *off){
+    if (undoState.top == NULL){
+        *c = undoState.head;
+        *off = 0;
+    } else {
+        *c = undoState.top;
+        *off = undoState.topOff + undoTop()->size;
+        if (*off >= (long)(*c)->used){
+            *c = (*c)->next;
+            *off = 0;
+        }
+    }
+    return *c && (*c)->used ? undoAt(*c, *off) : NULL;
+}
+
+void editorRedo(){
+    undoChunk *c;
+    long off;
+    undoRec *rec = undoNext(&c, &off);
+    if (rec == NULL){
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+
+    unsigned int group = rec->group;
+    undoState.replay = 1;
+    while (rec && rec->group == group){
+        editorUndoApply(rec, 1);
+        undoState.top = c;
+        undoState.topOff = off;
+        rec = undoNext(&c, &off);
+    }
+    undoState.replay = 0;
+    editorUndoBreak();
+}
+
+/*** journal ***/
+
+/* Edits also go to an append-only journal next to the file, named
+ * .NAME.kilo-journal, so a crash or a dropped connection loses at most the
+ * last KILO_JOURNAL_DELAY ms of them. The UI only copies each record into a
+ * buffer; a thread lets records pile up for KILO_JOURNAL_DELAY ms after the
+ * first, then writes them at once and syncs, so a run of typing costs one
+ * fdatasync.
+ * The header names the file the records apply to by device, inode, size and
+ * mtime, and opening that same file again replays them. A save starts the
+ * journal over from the saved file, and quitting removes it. */
+
+typedef struct journalHead{
+    char magic[8];
+    unsigned long long dev, ino;
+    long long size;
+    long long mtimeSec, mtimeNsec;
+} journalHead;
+
+typedef struct journalRec{
+    unsigned int sum;       // FNV-1a of the rest of the record and its text
+    unsigned int len;       // bytes of text after the record
+    int type;
+    int row, col;
+    int endRow, endCol;
+} journalRec;
+
+struct journalState{
+    char *path;             // NULL when not journaling
+    int fd;                 // -1 until the first edit creates the file
+    char *buf, *spare;      // records not written yet, and the buffer being written
+    size_t len, cap, spareCap;
+    long long end;          // journal bytes, written or not
+    long lastRec;           // offset in buf of an insert typing can still grow, or -1
+    int busy;               // the writer has the spare buffer out
+    int stop;
+    int failed;             // 1 on a write error, 2 once reported
+    int err;
+    int started;
+    int replay;             // applying the journal, so don't record it
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} journal;
+
+void journalInit(){
+    journal.fd = -1;
+    journal.lastRec = -1;
+    pthread_mutex_init(&journal.lock, NULL);
+    pthread_cond_init(&journal.cond, NULL);
+}
+
+unsigned int journalSum(unsigned int h, const char *p, size_t n){
+    for (size_t i = 0; i < n; i++){
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+unsigned int journalRecSum(journalRec *r, const char *text){
+    unsigned int h = journalSum(2166136261u, (char *)&r->type, sizeof(journalRec) - offsetof(journalRec, type));
+    return journalSum(h, text, r->len);
+}
+
+char *journalPath(const char *fileName){
+    const char *slash = strrchr(fileName, '/');
+    int dirLen = slash ? slash - fileName + 1 : 0;
+    size_t len = strlen(fileName) + 16;
+    char *path = malloc(len);
+    snprintf(path, len, "%.*s.%s.kilo-journal", dirLen, fileName, fileName + dirLen);
+    return path;
+}
+
+int journalIdentity(const char *fileName, journalHead *head){
+    struct stat st;
+    if (stat(fileName, &st) == -1) return -1;
+
+    memset(head, 0, sizeof(journalHead));
+    memcpy(head->magic, "KILOJNL1", 8);
+    head->dev = st.st_dev;
+    head->ino = st.st_ino;
+    head->size = st.st_size;
+    head->mtimeSec = st.st_mtim.tv_sec;
+    head->mtimeNsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/* Writes all of buf at the file position, resuming after short writes. */
+int journalWrite(int fd, const char *buf, size_t len){
+    while (len > 0){
+        ssize_t w = write(fd, buf, len);
+        if (w == -1){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* Opens path locked against other instances and writes the header for the
+ * file being edited. Returns the descriptor or -1. */
+int journalCreate(const char *path){
+    journalHead head;
+    if (journalIdentity(conf.filename, &head) == -1) return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1 || ftruncate(fd, 0) == -1 ||
+            journalWrite(fd, (char *)&head, sizeof(head)) == -1){
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+void *journalWorker(void *arg){
+    (void)arg;
+
+    pthread_mutex_lock(&journal.lock);
+    while (1){
+        while (journal.len == 0 && !journal.stop)
+            pthread_cond_wait(&journal.cond, &journal.lock);
+        if (journal.len == 0) break;
+
+        /* Let the rest of a burst of edits join this write. */
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += KILO_JOURNAL_DELAY * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        while (!journal.stop && journal.len &&
+               pthread_cond_timedwait(&journal.cond, &journal.lock, &until) != ETIMEDOUT);
+
+        /* A save may have rebased the journal meanwhile, taking what was
+         * queued along and maybe closing it. */
+        if (journal.len == 0 || journal.fd == -1){
+            journal.len = 0;
+            continue;
+        }
+
+        char *buf = journal.buf;
+        size_t len = journal.len, cap = journal.cap;
+        journal.buf = journal.spare;
+        journal.cap = journal.spareCap;
+        journal.spare = buf;
+        journal.spareCap = cap;
+        journal.len = 0;
+        journal.lastRec = -1;
+        journal.busy = 1;
+        int fd = journal.fd;
+        pthread_mutex_unlock(&journal.lock);
+
+        int ok = journalWrite(fd, buf, len) == 0 && fdatasync(fd) == 0;
+        int err = errno;
+
+        pthread_mutex_lock(&journal.lock);
+        journal.busy = 0;
+        if (!ok && !journal.failed){
+            journal.failed = 1;
+            journal.err = err;
+        }
+        pthread_cond_broadcast(&journal.cond);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return NULL;
+}
+
+/* Queues one edit for the journal. Inserts of a character right after the
+ * last insert grow it in place, the same way typing grows an undo record. */
+void editorJournal(int type, int row, int col, int endRow, int endCol, const char *text, size_t len){
+    if (journal.path == NULL || journal.replay) return;
+
+    pthread_mutex_lock(&journal.lock);
+    if (journal.fd == -1 && !journal.failed){
+        if ((journal.fd = journalCreate(journal.path)) == -1){
+            journal.failed = 1;
+            journal.err = errno;
+        } else
+            journal.end = sizeof(journalHead);
+    }
+    if (journal.failed){
+        if (journal.failed == 1)
+            editorSetStatusMessage("Journal off: %s", strerror(journal.err));
+        journal.failed = 2;
+        pthread_mutex_unlock(&journal.lock);
+        return;
+    }
+
+    journalRec rec;
+    if (type == JOURNAL_INSERT && len == 1 && text[0] != '\n' && journal.lastRec != -1){
+        memcpy(&rec, journal.buf + journal.lastRec, sizeof(rec));
+        if (rec.row == row && rec.col + (int)rec.len == col){
+            if (journal.len == journal.cap){
+                journal.cap = journal.cap * 2;
+                journal.buf = realloc(journal.buf, journal.cap);
+            }
+            journal.buf[journal.len++] = text[0];
+            journal.end++;
+            rec.len++;
+            rec.sum = journalSum(rec.sum, text, 1);
+            memcpy(journal.buf + journal.lastRec, &rec, sizeof(rec));
+            pthread_mutex_unlock(&journal.lock);
+            return;
+        }
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.len = len;
+    rec.type = type;
+    rec.row = row;
+    rec.col = col;
+    rec.endRow = endRow;
+    rec.endCol = endCol;
+    rec.sum = journalRecSum(&rec, text);
+
+    if (journal.len + sizeof(rec) + len > journal.cap){
+        journal.cap = journal.cap ? journal.cap * 2 : 4096;
+        if (journal.cap < journal.len + sizeof(rec) + len) journal.cap = journal.len + sizeof(rec) + len;
+        journal.buf = realloc(journal.buf, journal.cap);
+    }
+    int wake = journal.len == 0;
+    journal.lastRec = type == JOURNAL_INSERT && memchr(text, '\n', len) == NULL ? (long)journal.len : -1;
+    memcpy(journal.buf + journal.len, &rec, sizeof(rec));
+    memcpy(journal.buf + journal.len + sizeof(rec), text, len);
+    journal.len += sizeof(rec) + len;
+    journal.end += sizeof(rec) + len;
+
+    if (!journal.started){
+        journal.started = pthread_create(&journal.thread, NULL, journalWorker, NULL) == 0;
+        if (!journal.started){
+            journal.failed = 1;
+            journal.err = EAGAIN;
+        }
+    }
+    if (wake) pthread_cond_signal(&journal.cond);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/* Applies one record, after checking it fits the buffer. */
+int journalApply(journalRec *r, const char *text){
+    switch (r->type){
+        case JOURNAL_INSERT:
+            if (r->row < 0 || r->row > conf.numRows || r->col < 0) return 0;
+            conf.cY = r->row;
+            conf.cX = r->col;
+            editorInsertText(text, r->len);
+            return 1;
+
+        case JOURNAL_DELETE:
+            if (r->row < 0 || r->endRow < r->row || r->endRow >= conf.numRows) return 0;
+            if (r->col < 0 || r->col > editorRowAt(r->row)->tSize) return 0;
+            if (r->endCol < 0 || r->endCol > editorRowAt(r->endRow)->tSize) return 0;
+            if (r->row == r->endRow && r->endCol < r->col) return 0;
+            editorDelRange(r->row, r->col, r->endRow, r->endCol);
+            return 1;
+
+        case JOURNAL_DELROW:
+            if (r->row < 0 || r->row >= conf.numRows) return 0;
+            editorDelRow(r->row);
+            conf.cY = r->row;
+            conf.cX = 0;
+            return 1;
+    }
+    return 0;
+}
+
+/* Starts journaling the file just opened. A journal left behind for this
+ * same file is replayed, which costs time in the edits it holds, and is
+ * kept going; one left for another version of the file is moved aside. */
+void editorJournalOpen(){
+    journal.path = journalPath(conf.filename);
+    int fd = open(journal.path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return;
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1){
+        editorSetStatusMessage("%s is in use, not journaling", journal.path);
+        close(fd);
+        free(journal.path);
+        journal.path = NULL;
+        return;
+    }
+
+    journalHead want, head;
+    struct stat st;
+    if (journalIdentity(conf.filename, &want) == -1 || fstat(fd, &st) == -1 ||
+            pread(fd, &head, sizeof(head), 0) != sizeof(head) || memcmp(&head, &want, sizeof(head)) != 0){
+        size_t len = strlen(journal.path) + 5;
+        char *old = malloc(len);
+        snprintf(old, len, "%s.old", journal.path);
+        if (rename(journal.path, old) == 0)
+            editorSetStatusMessage("Journal is for another version of the file, moved to %s", old);
+        else {
+            editorSetStatusMessage("Journal is for another version of the file: %s", strerror(errno));
+            free(journal.path);
+            journal.path = NULL;
+        }
+        free(old);
+        close(fd);
+        return;
+    }
+
+    size_t size = st.st_size;
+    char *data = malloc(size);
+    size_t got = 0;
+    while (got < size){
+        ssize_t r = pread(fd, data + got, size - got, got);
+        if (r <= 0) break;
+        got += r;
+    }
+
+    /* Replay up to the first record that didn't make it to disk whole. */
+    size_t off = sizeof(head);
+    int edits = 0;
+    journal.replay = 1;
+    undoState.replay = 1;
+    while (off + sizeof(journalRec) <= got){
+        journalRec rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        char *text = data + off + sizeof(rec);
+        if (rec.len > got - off - sizeof(rec) || journalRecSum(&rec, text) != rec.sum) break;
+        if (!journalApply(&rec, text)) break;
+        off += sizeof(rec) + rec.len;
+        edits++;
+    }
+    journal.replay = 0;
+    undoState.replay = 0;
+    free(data);
+
+    if (ftruncate(fd, off) == -1 || lseek(fd, off, SEEK_SET) == -1){
+        editorSetStatusMessage("Journal off: %s", strerror(errno));
+        close(fd);
+        free(journal.path);
+        journal.path = NULL;
+        return;
+    }
+    journal.fd = fd;
+    journal.end = off;
+    editorSetStatusMessage("Recovered %d edit(s) from %s", edits, journal.path);
+}
+
+/* Bytes of journal so far, to tell which edits a save snapshot covers. */
+long long editorJournalMark(){
+    pthread_mutex_lock(&journal.lock);
+    long long end = journal.end;
+    journal.lastRec = -1;
+    pthread_mutex_unlock(&journal.lock);
+    return end;
+}
+
+/* After a save, the journal only needs the records past 'mark', which
+ * came after the snapshot, written against the file as saved: they are
+ * copied to a new journal that replaces the old one. With none, the
+ * journal is removed until the next edit. */
+void editorJournalRebase(long long mark){
+    if (conf.followPath || conf.filename == NULL) return;
+    char *path = journalPath(conf.filename);
+
+    pthread_mutex_lock(&journal.lock);
+    while (journal.busy) pthread_cond_wait(&journal.cond, &journal.lock);
+
+    /* A journal that failed to write can't be trusted to copy from, but
+     * the saved file is a fresh start. */
+    int fd = -1, failed = journal.failed;
+    long long end = 0;
+    journal.failed = 0;
+    if (journal.fd != -1 && journal.end > mark && !failed){
+        size_t tmpLen = strlen(path) + 8;
+        char *tmp = malloc(tmpLen);
+        snprintf(tmp, tmpLen, "%s.XXXXXX", path);
+
+        journalHead head;
+        long long written = journal.end - journal.len;
+        int ok = 0;
+        if (journalIdentity(conf.filename, &head) == 0 && (fd = mkstemp(tmp)) != -1){
+            ok = flock(fd, LOCK_EX | LOCK_NB) == 0 && journalWrite(fd, (char *)&head, sizeof(head)) == 0;
+            char chunk[65536];
+            for (long long off = mark; ok && off < written; ){
+                ssize_t r = pread(journal.fd, chunk, written - off < (long long)sizeof(chunk) ? written - off : (long long)sizeof(chunk), off);
+                ok = r > 0 && journalWrite(fd, chunk, r) == 0;
+                off += r;
+            }
+            size_t from = mark > written ? mark - written : 0;
+            ok = ok && journalWrite(fd, journal.buf + from, journal.len - from) == 0;
+            ok = ok && fdatasync(fd) == 0 && rename(tmp, path) == 0;
+            if (!ok){
+                int err = errno;
+                close(fd);
+                unlink(tmp);
+                fd = -1;
+                errno = err;
+            }
+        }
+        if (!ok){
+            editorSetStatusMessage("Journal off: %s", strerror(errno));
+            journal.failed = 2;
+        }
+        end = sizeof(head) + journal.end - mark;
+        free(tmp);
+    }
+
+    if (journal.fd != -1){
+        close(journal.fd);
+        if (fd == -1 || strcmp(journal.path, path) != 0) unlink(journal.path);
+    }
+    free(journal.path);
+    journal.path = path;
+    journal.fd = fd;
+    journal.end = fd == -1 ? 0 : end;
+    journal.len = 0;
+    journal.lastRec = -1;
+    pthread_cond_broadcast(&journal.cond);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/* Stops the writer once it has synced what is queued. With 'remove' the
+ * journal goes too, as the buffer it protects is being given up. */
+void editorJournalClose(int remove){
+    if (journal.started){
+        pthread_mutex_lock(&journal.lock);
+        journal.stop = 1;
+        pthread_cond_signal(&journal.cond);
+        pthread_mutex_unlock(&journal.lock);
+        pthread_join(journal.thread, NULL);
+        journal.started = 0;
+        journal.stop = 0;
+    }
+
+    if (journal.fd != -1){
+        close(journal.fd);
+        if (remove) unlink(journal.path);
+    }
+    free(journal.path);
+    free(journal.buf);
+    free(journal.spare);
+    journal.path = journal.buf = journal.spare = NULL;
+    journal.fd = -1;
+    journal.len = journal.cap = journal.spareCap = 0;
+    journal.end = 0;
+    journal.lastRec = -1;
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c){
+    int addRow = conf.cY == conf.numRows;
+    if (addRow)
+        editorInsertRow(conf.numRows, "", 0);
+
+    editorRow *eRow = editorRowEdit(conf.cY);
+    if (conf.cX > eRow->tSize) conf.cX = eRow->tSize;
+    char ch = c;
+    editorJournal(JOURNAL_INSERT, conf.cY, conf.cX, 0, 0, &ch, 1);
+    if (addRow || !editorUndoExtend(conf.cY, conf.cX, c)){
+        char *text = editorUndoPush(UNDO_INSERT, UNDO_TYPING, 0, conf.cY, conf.cX, 1, addRow);
+        if (text) text[0] = c;
+    }
+
+    editorRowInsertChar(eRow, conf.cX, c);
+    conf.cX++;
+}
+
+void editorInsertNewLine(){
+    if (conf.cY == conf.numRows){
+        editorJournal(JOURNAL_INSERT, conf.cY, 0, 0, 0, "", 0);
+        editorUndoPush(UNDO_INSERT, UNDO_OTHER, 0, conf.cY, 0, 0, 1);
+    } else {
+        editorRow *eRow = editorRowEdit(conf.cY);
+        if (conf.cX > eRow->tSize) conf.cX = eRow->tSize;
+        editorJournal(JOURNAL_INSERT, conf.cY, conf.cX, 0, 0, "\n", 1);
+        char *text = editorUndoPush(UNDO_INSERT, UNDO_OTHER, 0, conf.cY, conf.cX, 1, 0);
+        if (text) text[0] = '\n';
+    }
+
+    if (conf.cX == 0)
+        editorInsertRow(conf.cY, "", 0);
+    else {
+        editorRow *eRow = editorRowEdit(conf.cY);
+        editorInsertRow(conf.cY+1, &eRow->text[conf.cX], eRow->tSize - conf.cX);
+        eRow = editorRowEdit(conf.cY);
+        editorRowOwn(eRow);
+        eRow->tSize = conf.cX;
+        eRow->text[eRow->tSize] = '\0';
+        editorRowChanged(eRow, conf.cX);
+    }
+    conf.cY++;
+    conf.cX = 0;
+}
+
+/* Inserts a block of text at the cursor in one pass: the current row is cut
+ * at the cursor, the first line of the block is appended to it, the others
+ * become new rows created in bulk, and the cut-off tail is appended to the
+ * last one. */
+void editorInsertText(const char *s, size_t len){
+    editorJournal(JOURNAL_INSERT, conf.cY, conf.cX, 0, 0, s, len);
+    int addRow = conf.cY == conf.numRows;
+    if (addRow)
+        editorInsertRow(conf.numRows, "", 0);
+
+    editorRow *eRow = editorRowEdit(conf.cY);
+    if (conf.cX > eRow->tSize) conf.cX = eRow->tSize;
+
+    /* Count the lines, logging the text with every line break as '\n'. */
+    const char *end = s + len;
+    size_t logLen = 0;
+    int lines = 0;
+    for (const char *p = s; p < end; p++, logLen++){
+        if (*p == '\r' && p + 1 < end && p[1] == '\n') p++;
+        if (*p == '\r' || *p == '\n') lines++;
+    }
+    char *log = editorUndoPush(UNDO_INSERT, UNDO_OTHER, 0, conf.cY, conf.cX, logLen, addRow);
+    if (log){
+        for (const char *p = s; p < end; p++){
+            if (*p == '\r' && p + 1 < end && p[1] == '\n') p++;
+            *log++ = *p == '\r' ? '\n' : *p;
+        }
+    }
+
+    size_t tailLen = eRow->tSize - conf.cX;
+    char *tail = malloc(tailLen + 1);
+    memcpy(tail, &eRow->text[conf.cX], tailLen);
+
+    editorRowOwn(eRow);
+    eRow->tSize = conf.cX;
+    eRow->text[eRow->tSize] = '\0';
+
+    if (lines) editorInsertRowSlots(conf.cY + 1, lines);
+
+    const char *p = s;
+    for (int y = conf.cY; ; y++){
+        const char *nl = p;
+        while (nl < end && *nl != '\r' && *nl != '\n') nl++;
+
+        if (y == conf.cY)
+            editorRowAppendString(editorRowEdit(y), (char *)p, nl - p);
+        else {
+            int cap;
+            char *text = editorNewText(p, nl - p, &cap);
+            editorRowInit(editorRowEdit(y), text, nl - p, cap);
+        }
+
+        if (nl == end){
+            conf.cY = y;
+            conf.cX = nl - p;
+            break;
+        }
+        if (*nl == '\r' && nl + 1 < end && nl[1] == '\n') nl++;
+        p = nl + 1;
+    }
+
+    editorRowAppendString(editorRowEdit(conf.cY), tail, tailLen);
+    free(tail);
+}
+
+/* Deletes the text from row:col up to endRow:endCol, joining the two ends,
+ * and leaves the cursor where it started. */
+void editorDelRange(int row, int col, int endRow, int endCol){
+    editorJournal(JOURNAL_DELETE, row, col, endRow, endCol, "", 0);
+    if (!undoState.replay){
+        size_t len = 0;
+        for (int y = row; y <= endRow; y++){
+            editorRow *eRow = editorRowAt(y);
+            len += (y == endRow ? endCol : eRow->tSize) - (y == row ? col : 0) + (y < endRow);
+        }
+
+        char *log = editorUndoPush(UNDO_DELETE, UNDO_OTHER, 0, row, col, len, 0);
+        for (int y = row; log && y <= endRow; y++){
+            editorRow *eRow = editorRowAt(y);
+            int from = y == row ? col : 0;
+            int to = y == endRow ? endCol : eRow->tSize;
+            memcpy(log, &eRow->text[from], to - from);
+            log += to - from;
+            if (y < endRow) *log++ = '\n';
+        }
+    }
+
+    editorRow *first = editorRowEdit(row);
+    editorRowOwn(first);
+    if (row == endRow){
+        memmove(&first->text[col], &first->text[endCol], first->tSize - endCol + 1);
+        first->tSize -= endCol - col;
+        editorRowChanged(first, col);
+        conf.dirty++;
+    } else {
+        editorRow *last = editorRowAt(endRow);
+        first->tSize = col;
+        editorRowAppendString(first, &last->text[endCol], last->tSize - endCol);
+        editorDelRows(row + 1, endRow - row);
+    }
+
+    conf.cY = row;
+    conf.cX = col;
+}
+
+void editorPaste(){
+    size_t len;
+    char *text = editorReadPaste(&len);
+    editorInsertText(text, len);
+    free(text);
+}
+
+void editorDelChar(){
+    if (conf.cY == conf.numRows) return;
+    if (conf.cX == 0 && conf.cY == 0) return;
+
+
+    editorRow *eRow = editorRowEdit(conf.cY);
+    if (conf.cX > eRow->tSize) conf.cX = eRow->tSize;
+    if (conf.cX > 0){
+        int from = utf8Prev(eRow->text, conf.cX, eRow->tSize);
+        editorJournal(JOURNAL_DELETE, conf.cY, from, conf.cY, conf.cX, "", 0);
+        int join = editorUndoJoins(conf.cY, from, conf.cY, conf.cX);
+        char *log = editorUndoPush(UNDO_DELETE, UNDO_DELETING, join, conf.cY, from, conf.cX - from, 0);
+        if (log) memcpy(log, &eRow->text[from], conf.cX - from);
+
+        while (conf.cX > from) editorRowDelChar(eRow, --conf.cX);
+    } else {
+        editorRow *prev = editorRowEdit(conf.cY - 1);
+        editorJournal(JOURNAL_DELETE, conf.cY - 1, prev->tSize, conf.cY, 0, "", 0);
+        int join = editorUndoJoins(conf.cY - 1, prev->tSize, conf.cY, 0);
+        char *log = editorUndoPush(UNDO_DELETE, UNDO_DELETING, join, conf.cY - 1, prev->tSize, 1, 0);
+        if (log) log[0] = '\n';
+
+        conf.cX = prev->tSize;
+        editorRowAppendString(prev, eRow->text, eRow->tSize);
+        editorDelRow(conf.cY);
+        conf.cY--;
+    }
+}
+
+/*** file i/o ***/
+
+/* A stretch of the mapping loaded by one thread. Chunks start and end on
+ * line boundaries, so each holds a known number of whole lines. */
+typedef struct openChunk{
+    char *p, *end;
+    int first;              // index of the chunk's first row
+    int lines;
+    pthread_t thread;
+} openChunk;
+
+void *openCountWorker(void *arg){
+    openChunk *c = arg;
+    int lines = 0;
+    for (char *p = c->p; p < c->end && (p = memchr(p, '\n', c->end - p)); p++)
+        lines++;
+    if (c->p < c->end && c->end[-1] != '\n') lines++;
+    c->lines = lines;
+    return NULL;
+}
+
+/* Stores the length of the line at p, less its line ending, and returns
+ * where the next one starts. */
+char *openLine(char *p, char *end, size_t *len){
+    char *nl = memchr(p, '\n', end - p);
+    char *next = nl ? nl + 1 : end;
+    if (!nl) nl = end;
+
+    size_t lineLen = nl - p;
+    while (lineLen > 0 && p[lineLen - 1] == '\r')
+        lineLen--;
+    *len = lineLen;
+    return next;
+}
+
+/* Fills in the chunk's rows, which the buffer holds in full blocks from
+ * row 0 on. */
+void *openFillWorker(void *arg){
+    openChunk *c = arg;
+    int b = c->first / KILO_ROW_BLOCK, off = c->first % KILO_ROW_BLOCK;
+
+    for (char *p = c->p; p < c->end;){
+        size_t lineLen;
+        char *next = openLine(p, c->end, &lineLen);
+
+        if (off == KILO_ROW_BLOCK){
+            b++;
+            off = 0;
+        }
+        editorRowInit(&conf.blocks[b].rows[off++], p, lineLen, 0);
+        p = next;
+    }
+    return NULL;
+}
+
+/* Runs fn over every chunk, the first on this thread and the others on
+ * threads of their own. */
+void openRun(openChunk *chunks, int n, void *(*fn)(void *)){
+    int started[KILO_MAX_WORKERS] = {0};
+    for (int i = 1; i < n; i++)
+        started[i] = pthread_create(&chunks[i].thread, NULL, fn, &chunks[i]) == 0;
+    fn(&chunks[0]);
+    for (int i = 1; i < n; i++){
+        if (started[i]) pthread_join(chunks[i].thread, NULL);
+        else fn(&chunks[i]);
+    }
+}
+
+/* Rows borrow their text from a private read-only mapping of the file, so
+ * opening costs one newline scan and a row struct per line. Text and render
+ * buffers are only allocated for rows that get edited or drawn. Big files
+ * are split into chunks scanned on several threads: one pass counts the
+ * lines, the rows are made in bulk, and a second pass fills them in. */
+int editorOpenMapped(char *fileName){
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0){
+        close(fd);
+        return -1;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    conf.map = map;
+    conf.mapSize = st.st_size;
+    conf.mapStat = st;
+    conf.mapLive = 1;
+
+    /* Under a memory budget the rows are made one at a time instead, so
+     * what has been loaded can be trimmed as the load goes on. */
+    if (mem.limit){
+        for (char *p = map, *end = map + st.st_size; p < end;){
+            size_t lineLen;
+            char *next = openLine(p, end, &lineLen);
+            editorRowInit(editorInsertRowSlot(conf.numRows), p, lineLen, 0);
+            if (conf.numRows % KILO_TRIM_ROWS == 0) editorMemTrim(1);
+            p = next;
+        }
+        return 0;
+    }
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > st.st_size / KILO_OPEN_CHUNK) n = st.st_size / KILO_OPEN_CHUNK;
+    if (n > KILO_MAX_WORKERS) n = KILO_MAX_WORKERS;
+    if (n < 1) n = 1;
+
+    openChunk chunks[KILO_MAX_WORKERS];
+    char *p = map, *end = map + st.st_size;
+    for (int i = 0; i < n; i++){
+        char *cut = i == n - 1 ? end : map + st.st_size / n * (i + 1);
+        if (cut < p) cut = p;
+        if (cut < end){
+            char *nl = memchr(cut, '\n', end - cut);
+            cut = nl ? nl + 1 : end;
+        }
+        chunks[i].p = p;
+        chunks[i].end = cut;
+        p = cut;
+    }
+
+    openRun(chunks, n, openCountWorker);
+    int total = 0;
+    for (int i = 0; i < n; i++){
+        chunks[i].first = total;
+        total += chunks[i].lines;
+    }
+
+    editorInsertRowSlots(0, total);
+    openRun(chunks, n, openFillWorker);
+
+    return 0;
+}
+
+/* Reads rows from a file that can't be mapped, like a pipe. */
+void editorLoad(FILE *fp){
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t lineLen;
+
+    while ((lineLen = getline(&line, &lineCap, fp)) != -1){
+        while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) 
+            lineLen--;
+
+        editorInsertRow(conf.numRows, line, lineLen);
+        if (conf.numRows % KILO_TRIM_ROWS == 0) editorMemTrim(1);
+    }
+
+    free(line);
+    conf.dirty = 0;   
+}
+
+void editorOpen(char *fileName){
+    free(conf.filename);
+    conf.filename = strdup(fileName);
+    editorSelectSyntax();
+
+    if (editorOpenMapped(fileName) == 0){
+        /* Every row matches the file now. */
+        for (int b = 0; b < conf.numBlocks; b++) conf.blocks[b].edited = 0;
+        conf.dirty = 0;
+        return;
+    }
+    
+    FILE *fp = fopen(fileName, "r");
+    if (!fp) die("fopen");
+    editorLoad(fp);
+    fclose(fp); 
+}
+
+/* Writes a whole iovec batch, resuming after short writes. Returns the
+ * byte count or -1. */
+long long editorWritev(int fd, struct iovec *iov, int n){
+    long long total = 0;
+    while (n > 0){
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += w;
+        while (n > 0 && (size_t)w >= iov->iov_len){
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0){
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return total;
+}
+
+/* A run of rows that differ from the file, and where in it they go. */
+typedef struct saveRange{
+    long long off, len;
+    int block, row;         // the first row, in the snapshot's block list
+    int numRows;
+} saveRange;
+
+/* A save in flight. The worker owns everything here until it sets done. */
+typedef struct saveJob{
+    char *filename;
+    rowBlock *blocks;       // the block list as it was when the save started
+    int numBlocks;
+    int numRows;
+    int rowsToWrite;        // numRows, or the rows in the ranges
+    int rowsDone;
+    int dirty;              // conf.dirty covered by this save
+    long long journalMark;  // journal bytes the snapshot covers
+    int inPlace;            // write just the ranges over the file, which st describes
+    saveRange *ranges;
+    int numRanges;
+    long long size;         // the file size after the ranges are written
+    struct stat st;         // and the file as the in-place save left it
+    long long written;      // bytes written, or -1 on failure
+    int err;
+    int done;
+    pthread_t thread;
+} saveJob;
+
+/* Streams 'count' rows of the snapshot from row j of block b on, each with
+ * its newline, to fd straight from the row buffers, KILO_SAVE_IOV buffers
+ * per writev call. Returns the byte count or -1. */
+long long editorWriteRows(int fd, saveJob *job, int b, int j, int count){
+    static char newline = '\n';
+    struct iovec iov[KILO_SAVE_IOV];
+    long long total = 0, w;
+    int n = 0, shown = 0, dropped = b;
+
+    for (; count > 0; b++, j = 0){
+        rowBlock *blk = &job->blocks[b];
+        int end = blk->numRows - j < count ? blk->numRows : j + count;
+        count -= end - j;
+        for (int r = j; r < end; r++){
+            editorRow *eRow = &blk->rows[r];
+            if (n == KILO_SAVE_IOV){
+                if ((w = editorWritev(fd, iov, n)) == -1) return -1;
+                total += w;
+                n = 0;
+                /* Under a memory budget, the pages of rows written out
+                 * are let go as the save goes. */
+                for (; mem.limit && dropped < b; dropped++) memDropBlock(&job->blocks[dropped]);
+            }
+            iov[n].iov_base = eRow->text;
+            iov[n++].iov_len = eRow->tSize;
+            iov[n].iov_base = &newline;
+            iov[n++].iov_len = 1;
+        }
+
+        int done = __atomic_add_fetch(&job->rowsDone, end - j, __ATOMIC_RELAXED);
+        if (done * 100LL / job->rowsToWrite > shown){
+            shown = done * 100LL / job->rowsToWrite;
+            editorWake();
+        }
+    }
+
+    if ((w = editorWritev(fd, iov, n)) == -1) return -1;
+    return total + w;
+}
+
+/* Writes just the ranges over the file and cuts it to its new size. This
+ * is not atomic like a full save, but costs what was edited rather than
+ * the file size. Returns the byte count, or -2 when the file is no longer
+ * the one the ranges were worked out against or writing them failed. The
+ * snapshot is then saved whole instead, which also replaces a file left
+ * half written: rows outside the ranges still read what they borrow from
+ * conf.map, as nothing was written under them. */
+long long editorSaveInPlace(saveJob *job, const char *target){
+    int fd = open(target, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -2;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_dev != job->st.st_dev || st.st_ino != job->st.st_ino ||
+            st.st_size != job->st.st_size || st.st_mtim.tv_sec != job->st.st_mtim.tv_sec ||
+            st.st_mtim.tv_nsec != job->st.st_mtim.tv_nsec){
+        close(fd);
+        return -2;
+    }
+
+    /* Space the file grows by is claimed first, so a full disk stops the
+     * save before anything is overwritten. */
+    if (job->size > st.st_size && posix_fallocate(fd, st.st_size, job->size - st.st_size) != 0){
+        ftruncate(fd, st.st_size);
+        close(fd);
+        return -2;
+    }
+
+    long long total = 0, w;
+    for (int i = 0; i < job->numRanges && total != -1; i++){
+        saveRange *r = &job->ranges[i];
+        if (lseek(fd, r->off, SEEK_SET) == -1 ||
+                (w = editorWriteRows(fd, job, r->block, r->row, r->numRows)) == -1)
+            total = -1;
+        else
+            total += w;
+    }
+    if (total != -1 && job->size != st.st_size && ftruncate(fd, job->size) == -1) total = -1;
+    if (total != -1 && fsync(fd) == -1) total = -1;
+    if (total != -1 && fstat(fd, &job->st) == -1) total = -1;
+    if (close(fd) == -1) total = -1;
+    return total == -1 ? -2 : total;
+}
+
+/* Saves by writing a temp file next to the target, syncing it and renaming
+ * it into place, so a failed save leaves the old file untouched. Rows still
+ * borrowing from conf.map keep working: the mapping pins the old inode.
+ * A save planned in place writes over the file instead. */
+void *editorSaveWorker(void *arg){
+    saveJob *job = arg;
+
+    char *target = realpath(job->filename, NULL);
+    if (target == NULL) target = strdup(job->filename);
+
+    long long len = -2;
+    if (job->inPlace) len = editorSaveInPlace(job, target);
+    job->inPlace = len != -2;
+    job->err = errno;
+
+    if (len == -2){
+        __atomic_store_n(&job->rowsToWrite, job->numRows, __ATOMIC_RELAXED);
+        __atomic_store_n(&job->rowsDone, 0, __ATOMIC_RELAXED);
+
+        size_t tmpLen = strlen(target) + 8;
+        char *tmp = malloc(tmpLen);
+        snprintf(tmp, tmpLen, "%s.XXXXXX", target);
+
+        struct stat st;
+        mode_t mode;
+        if (stat(target, &st) == 0)
+            mode = st.st_mode & 07777;
+        else {
+            mode_t mask = umask(0);
+            umask(mask);
+            mode = 0664 & ~mask;
+        }
+
+        len = -1;
+        int fd = mkstemp(tmp);
+        if (fd != -1){
+            if (fchmod(fd, mode) != -1) len = editorWriteRows(fd, job, 0, 0, job->numRows);
+            if (len != -1 && fsync(fd) == -1) len = -1;
+            if (close(fd) == -1) len = -1;
+            if (len != -1 && rename(tmp, target) == -1) len = -1;
+            if (len == -1) unlink(tmp);
+        }
+        job->err = errno;
+        free(tmp);
+    }
+
+    if (len != -1 && !job->inPlace){
+        char *slash = strrchr(target, '/');
+        if (slash) *slash = '\0';
+        int dirFd = open(slash ? (slash == target ? "/" : target) : ".", O_RDONLY | O_DIRECTORY);
+        if (dirFd != -1){
+            fsync(dirFd);
+            close(dirFd);
+        }
+    }
+
+    free(target);
+
+    job->written = len;
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    editorWake();
+    return NULL;
+}
+
+/* A row matches the file when it still borrows its text from conf.map at
+ * the offset a save would write it to, with a newline after it there.
+ * 'limit' is the end of what conf.map holds of the file. */
+int saveRowInPlace(editorRow *eRow, long long off, long long limit){
+    return !eRow->owned && off + eRow->tSize < limit &&
+           eRow->text == conf.map + off && conf.map[off + eRow->tSize] == '\n';
+}
+
+/* Rows of a block not edited since it matched the file are consecutive
+ * lines of it, so its first and last row being in place means all are:
+ * a '\r' dropped anywhere between would put the last one off. */
+int saveBlockInPlace(rowBlock *blk, long long off, long long limit){
+    if (blk->edited || blk->numRows == 0) return 0;
+    editorRow *last = &blk->rows[blk->numRows - 1];
+    return saveRowInPlace(&blk->rows[0], off, limit) &&
+           saveRowInPlace(last, off + blk->bytes - last->tSize - 1, limit);
+}
+
+/* Works out which runs of rows differ from the file on disk, looking row by
+ * row only in the blocks edited since they matched it. Writing those over
+ * the file is the plan when the file is still the one conf.map maps and
+ * they come to at most half of it and KILO_SAVE_IN_PLACE. The rows in them
+ * then get their own copy of their text, since the save overwrites what
+ * they borrow. Returns 0 with the plan in the job, or -1. */
+int editorSavePlan(saveJob *job){
+    struct stat st;
+    if (!conf.mapLive || conf.followPath || stat(conf.filename, &st) == -1 ||
+            st.st_dev != conf.mapStat.st_dev || st.st_ino != conf.mapStat.st_ino ||
+            st.st_size != conf.mapStat.st_size || st.st_mtim.tv_sec != conf.mapStat.st_mtim.tv_sec ||
+            st.st_mtim.tv_nsec != conf.mapStat.st_mtim.tv_nsec)
+        return -1;
+
+    byteIndexSync();
+    long long size = byteFenSum(conf.numBlocks);
+    long long limit = st.st_size < (off_t)conf.mapSize ? (long long)st.st_size : (long long)conf.mapSize;
+    long long most = size / 2 < KILO_SAVE_IN_PLACE ? size / 2 : KILO_SAVE_IN_PLACE;
+    if (mem.limit && most > (long long)(mem.limit / 4)) most = mem.limit / 4;
+
+    saveRange *ranges = NULL;
+    int numRanges = 0, rangeCap = 0, rows = 0;
+    long long off = 0, bytes = 0;
+    for (int b = 0; b < conf.numBlocks && bytes <= most; b++){
+        rowBlock *blk = &conf.blocks[b];
+        if (saveBlockInPlace(blk, off, limit)){
+            off += blk->bytes;
+            continue;
+        }
+
+        int clean = 1;
+        for (int j = 0; j < blk->numRows; j++){
+            editorRow *eRow = &blk->rows[j];
+            if (blk->edited && saveRowInPlace(eRow, off, limit)){
+                off += eRow->tSize + 1;
+                continue;
+            }
+
+            clean = 0;
+            saveRange *r = numRanges ? &ranges[numRanges - 1] : NULL;
+            if (r == NULL || r->off + r->len != off){
+                if (numRanges == rangeCap){
+                    rangeCap = rangeCap ? rangeCap * 2 : 16;
+                    ranges = realloc(ranges, sizeof(saveRange) * rangeCap);
+                }
+                r = &ranges[numRanges++];
+                r->off = off;
+                r->len = 0;
+                r->block = b;
+                r->row = j;
+                r->numRows = 0;
+            }
+            r->len += eRow->tSize + 1;
+            r->numRows++;
+            rows++;
+            bytes += eRow->tSize + 1;
+            off += eRow->tSize + 1;
+        }
+        if (clean) blk->edited = 0;
+    }
+
+    if (bytes > most){
+        free(ranges);
+        return -1;
+    }
+
+    for (int i = 0; i < numRanges; i++){
+        int b = ranges[i].block, j = ranges[i].row;
+        for (int k = 0; k < ranges[i].numRows; k++, j++){
+            if (j == conf.blocks[b].numRows){
+                b++;
+                j = 0;
+            }
+            if (k == 0 || j == 0){
+                blockThaw(b);
+                conf.blocks[b].edited = 1;
+            }
+            editorRowOwn(&conf.blocks[b].rows[j]);
+        }
+    }
+
+    job->inPlace = 1;
+    job->ranges = ranges;
+    job->numRanges = numRanges;
+    job->rowsToWrite = rows;
+    job->size = size;
+    job->st = st;
+    return 0;
+}
+
+/* After an in-place save nothing was edited during, the rows it wrote
+ * match the file again, so they go back to borrowing from conf.map, which
+ * reads the bytes just written. */
+void editorSaveSettle(saveJob *job){
+    if (conf.dirty) return;
+
+    long long limit = job->size < (long long)conf.mapSize ? job->size : (long long)conf.mapSize;
+    for (int i = 0; i < job->numRanges; i++){
+        int b = job->ranges[i].block, j = job->ranges[i].row;
+        long long off = job->ranges[i].off;
+        for (int k = 0; k < job->ranges[i].numRows; k++, j++){
+            if (j == conf.blocks[b].numRows){
+                b++;
+                j = 0;
+            }
+            editorRow *eRow = &conf.blocks[b].rows[j];
+            if (eRow->owned && off + eRow->tSize < limit && conf.map[off + eRow->tSize] == '\n'){
+                slabFree(eRow->text, eRow->tCap);
+                eRow->text = conf.map + off;
+                eRow->tCap = 0;
+                eRow->owned = 0;
+            }
+            off += eRow->tSize + 1;
+        }
+    }
+}
+
+void editorSaveFree(saveJob *job){
+    free(job->filename);
+    free(job->blocks);
+    free(job->ranges);
+    free(job);
+}
+
+/* Settles a save that finished while a search was running, once the search
+ * workers are off the rows. A newer save drops it instead. */
+void editorSaveSettleDeferred(){
+    if (conf.settleJob == NULL || conf.findBusy) return;
+
+    editorSaveSettle(conf.settleJob);
+    editorSaveFree(conf.settleJob);
+    conf.settleJob = NULL;
+}
+
+/* Picks up a finished save whose thread has been joined and frees its job.
+ * Edits made while it ran stay counted in conf.dirty. */
+void editorSaveFinish(saveJob *job){
+    conf.saveJob = NULL;
+    editorGraveFree();
+
+    if (job->written == -1)
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    else {
+        conf.dirty -= job->dirty;
+        if (job->inPlace){
+            editorSetStatusMessage("%lld bytes written to disk in place", job->written);
+            conf.mapStat = job->st;
+            /* Search workers read row texts without a lock. */
+            if (!conf.findBusy)
+                editorSaveSettle(job);
+            else if (conf.settleJob == NULL)
+                conf.settleJob = job;
+        } else {
+            editorSetStatusMessage("%lld bytes written to disk", job->written);
+            conf.mapLive = 0;
+        }
+        editorJournalRebase(job->journalMark);
+        if (conf.followPath) editorFollowReopen(job->written);
+    }
+
+    if (job != conf.settleJob) editorSaveFree(job);
+
+    if (conf.saveAgain){
+        conf.saveAgain = 0;
+        editorSave();
+    }
+}
+
+void editorSavePoll(){
+    saveJob *job = conf.saveJob;
+    if (job == NULL || !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) return;
+
+    pthread_join(job->thread, NULL);
+    editorSaveFinish(job);
+}
+
+/* Also runs the save asked for while this one was going. */
+void editorSaveWait(){
+    saveJob *job;
+    while ((job = conf.saveJob) != NULL){
+        pthread_join(job->thread, NULL);
+        editorSaveFinish(job);
+    }
+}
+
+/* Snapshots the buffer, which only copies the block list, and hands it to
+ * a thread that writes it out while editing goes on. */
+void editorSave(){
+    /* The wake for a save that is done may still be queued behind keys. */
+    editorSavePoll();
+    if (conf.saveJob){
+        conf.saveAgain = 1;
+        editorSetStatusMessage("Save in progress, saving again when it is done");
+        return;
+    }
+
+    if (conf.filename == NULL){
+        conf.filename = editorPrompt("Save as: %s", NULL);
+        if (conf.filename == NULL){
+            editorSetStatusMessage("Save canceled");
+            return;
+        }
+        editorSelectSyntax();
+    }
+
+    if (conf.settleJob){
+        editorSaveFree(conf.settleJob);
+        conf.settleJob = NULL;
+    }
+
+    saveJob *job = calloc(1, sizeof(saveJob));
+    job->filename = strdup(conf.filename);
+    editorSavePlan(job);
+    job->numBlocks = conf.numBlocks;
+    job->blocks = malloc(sizeof(rowBlock) * (conf.numBlocks ? conf.numBlocks : 1));
+    memcpy(job->blocks, conf.blocks, sizeof(rowBlock) * conf.numBlocks);
+    job->numRows = conf.numRows;
+    if (!job->inPlace) job->rowsToWrite = conf.numRows;
+    job->dirty = conf.dirty;
+    job->journalMark = editorJournalMark();
+
+    conf.saveEpoch++;
+    conf.saveJob = job;
+    int err = pthread_create(&job->thread, NULL, editorSaveWorker, job);
+    if (err != 0){
+        conf.saveJob = NULL;
+        editorSaveFree(job);
+        editorSetStatusMessage("Can't save! %s", strerror(err));
+    }
+}
+
+double editorNowMs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Drops the whole buffer. Row buffers go back a slab page at a time rather
+ * than row by row. */
+void editorClose(){
+    editorSaveWait();
+    if (conf.settleJob){
+        editorSaveFree(conf.settleJob);
+        conf.settleJob = NULL;
+    }
+    editorJournalClose(1);
+
+#ifdef KILO_MALLOC_ROWS
+    for (int b = 0; b < conf.numBlocks; b++)
+        for (int j = 0; j < conf.blocks[b].numRows; j++)
+            editorFreeRow(&conf.blocks[b].rows[j]);
+#else
+    slabFreeAll();
+#endif
+    for (int b = 0; b < conf.numBlocks; b++) blockFreeRows(&conf.blocks[b]);
+    memSpillClose();
+    conf.numBlocks = 0;
+    conf.numRows = 0;
+    conf.renderBytes = 0;
+    blockFenBuild();
+
+    if (conf.map){
+        munmap(conf.map, conf.mapSize);
+        conf.map = NULL;
+        conf.mapSize = 0;
+        conf.mapLive = 0;
+    }
+}
+
+/* With KILO_STATS set in the environment, quitting reports what the row
+ * buffers cost, to compare against a -DKILO_MALLOC_ROWS build. */
+void editorCloseStats(){
+    if (getenv("KILO_STATS") == NULL){
+        editorClose();
+        return;
+    }
+
+    fprintf(stderr, "%s: %d rows, opened in %.1f ms\n",
+            conf.filename ? conf.filename : "[No name]", conf.numRows, conf.openMs);
+    fprintf(stderr, "row buffers (%s): %lld allocs, %lld frees, %zu KB live, %zu KB reserved\n",
+#ifdef KILO_MALLOC_ROWS
+            "malloc",
+#else
+            "slab",
+#endif
+            slab.allocs, slab.frees, slab.liveBytes / 1024, slab.reservedBytes / 1024);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+    fprintf(stderr, "heap: %zu KB in use, %zu KB mapped\n",
+            (mi.uordblks + mi.hblkhd) / 1024, (mi.arena + mi.hblkhd) / 1024);
+#endif
+
+    double start = editorNowMs();
+    editorClose();
+    fprintf(stderr, "closed in %.1f ms\n", editorNowMs() - start);
+}
+
+/*** follow ***/
+
+/* With -f the file is watched with inotify, and whatever gets appended is
+ * read from where the last read stopped and added as rows in one batch, so
+ * a fast writer costs one read and one repaint per wakeup rather than per
+ * line. Appended rows mirror the file: they are not undoable and do not
+ * make the buffer dirty. If the path comes to name another file (the log
+ * was rotated, or we saved over it) the new file is followed from its
+ * start. */
+void editorFollowStart(char *path){
+    free(conf.filename);
+    conf.filename = strdup(path);
+    editorSelectSyntax();
+
+    conf.followFile = open(path, O_RDONLY | O_CLOEXEC);
+    conf.followFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (conf.followFile == -1 || conf.followFd == -1) die("follow");
+
+    struct stat st;
+    if (fstat(conf.followFile, &st) == -1 || !S_ISREG(st.st_mode)){
+        errno = EINVAL;
+        die("follow needs a regular file");
+    }
+
+    conf.followPath = strdup(path);
+    conf.followWd = inotify_add_watch(conf.followFd, path, IN_MODIFY | IN_ATTRIB |
+                                      IN_MOVE_SELF | IN_DELETE_SELF);
+    char *slash = strrchr(conf.followPath, '/');
+    if (slash) *slash = '\0';
+    conf.followDirWd = inotify_add_watch(conf.followFd, slash ? (slash == conf.followPath ? "/" : conf.followPath) : ".",
+                                         IN_CREATE | IN_MOVED_TO);
+    if (slash) *slash = '/';
+    if (conf.followWd == -1 || conf.followDirWd == -1) die("inotify_add_watch");
+
+    /* The file is read the way appends are, into rows that own their text:
+     * rows borrowed from a mapping would point past the end of the file
+     * once it is truncated in place, and reading them would fault. */
+    conf.followOff = 0;
+    conf.followPartial = 0;
+    conf.followBuf = malloc(KILO_FOLLOW_CHUNK);
+    editorWatch(conf.followFd, EV_FOLLOW);
+    editorFollowPoll();
+    conf.cY = 0;
+    conf.cX = 0;
+}
+
+/* Follows whatever the path names now, from 'off' on. */
+void editorFollowReopen(long long off){
+    int fd = open(conf.followPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+
+    inotify_rm_watch(conf.followFd, conf.followWd);
+    conf.followWd = inotify_add_watch(conf.followFd, conf.followPath, IN_MODIFY | IN_ATTRIB |
+                                      IN_MOVE_SELF | IN_DELETE_SELF);
+    close(conf.followFile);
+    conf.followFile = fd;
+    conf.followOff = off;
+    conf.followPartial = 0;
+    conf.followReplaced = 0;
+}
+
+/* Adds n bytes read from the end of the file as rows. */
+void editorFollowAppend(char *buf, size_t n){
+    char *p = buf, *end = buf + n;
+    int atEnd = conf.cY >= conf.numRows - 1;
+    int dirty = conf.dirty;
+
+    if (conf.followPartial && conf.numRows){
+        char *nl = memchr(p, '\n', end - p);
+        size_t len = (nl ? nl : end) - p;
+        if (nl && len && p[len - 1] == '\r') len--;
+        editorRowAppendString(editorRowEdit(conf.numRows - 1), p, len);
+        conf.followPartial = nl == NULL;
+        p = nl ? nl + 1 : end;
+    }
+
+    int lines = 0;
+    for (char *q = p; q < end && (q = memchr(q, '\n', end - q)); q++) lines++;
+    if (p < end && end[-1] != '\n') lines++;
+
+    int at = conf.numRows;
+    editorInsertRowSlots(at, lines);
+    for (int i = 0; i < lines; i++){
+        char *nl = memchr(p, '\n', end - p);
+        size_t len = (nl ? nl : end) - p;
+        conf.followPartial = nl == NULL;
+        if (nl && len && p[len - 1] == '\r') len--;
+
+        int cap;
+        char *text = editorNewText(p, len, &cap);
+        editorRowInit(editorRowAt(at + i), text, len, cap);
+        p = nl ? nl + 1 : end;
+    }
+
+    conf.dirty = dirty;
+    editorUndoBreak();
+    if (atEnd && conf.numRows){
+        conf.cY = conf.numRows - 1;
+        conf.cX = 0;
+    }
+}
+
+void editorFollowPoll(){
+    if (conf.followPath == NULL) return;
+
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char *slash = strrchr(conf.followPath, '/');
+    const char *base = slash ? slash + 1 : conf.followPath;
+    ssize_t len;
+    while ((len = read(conf.followFd, events, sizeof(events))) > 0){
+        for (char *p = events; p < events + len; ){
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->wd == conf.followDirWd ? ev->len && strcmp(ev->name, base) == 0 :
+                                            (ev->mask & ~IN_MODIFY) != 0)
+                conf.followReplaced = 1;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    /* Search workers read the rows without a lock, so nothing is added
+     * while they run; editorFrame() polls again once they are done. */
+    conf.followDeferred = conf.findBusy;
+    if (conf.findBusy) return;
+
+    struct stat st;
+    if (fstat(conf.followFile, &st) == -1) return;
+    if (st.st_size < conf.followOff){
+        editorSetStatusMessage("%s: file truncated", conf.followPath);
+        conf.followOff = 0;
+        conf.followPartial = 0;
+    }
+
+    ssize_t n;
+    while ((n = pread(conf.followFile, conf.followBuf, KILO_FOLLOW_CHUNK, conf.followOff)) > 0){
+        conf.followOff += n;
+        editorFollowAppend(conf.followBuf, n);
+        editorMemTrim(1);
+    }
+
+    /* A save of our own replaces the file too, and reopens it itself once
+     * it is done. */
+    struct stat now;
+    if (conf.followReplaced && conf.saveJob == NULL && stat(conf.followPath, &now) == 0){
+        conf.followReplaced = 0;
+        if (now.st_ino != st.st_ino || now.st_dev != st.st_dev){
+            editorSetStatusMessage("%s: file replaced, following the new one", conf.followPath);
+            editorFollowReopen(0);
+            editorFollowPoll();
+        }
+    }
+}
+
+/*** regex ***/
+
+/* Patterns are parsed into a small syntax tree and compiled twice into
+ * Thompson NFAs: once as written and once reversed. Matching runs lazily
+ * built DFAs over them, so every byte costs one table lookup once the
+ * states it needs exist. A right-to-left pass of the unanchored reverse
+ * DFA marks every position a match can start at; the forward DFA then
+ * extends each start to its longest match. DFA caches are bounded and
+ * flushed when full, so patterns with an exploding state space degrade to
+ * NFA speed instead of eating memory, and nothing in the matcher
+ * backtracks. */
+
+#define RE_MAX_NFA 4096
+#define RE_MAX_DFA 1024
+#define RE_MAX_REPEAT 256
+#define RE_CACHE 8
+#define RE_SLOTS (KILO_MAX_WORKERS + 1)     // slot 0 is the UI thread
+
+enum reNodeType{
+    RN_SET,
+    RN_EMPTY,
+    RN_CAT,
+    RN_ALT,
+    RN_REPEAT,
+    RN_BOL,
+    RN_EOL
+};
+
+typedef struct reNode{
+    int type;
+    int a, b;
+    int min, max;       // RN_REPEAT; max is -1 when unbounded
+    unsigned char set[32];
+} reNode;
+
+typedef struct reParser{
+    const char *p;
+    reNode *nodes;
+    int numNodes, cap;
+    const char *err;
+} reParser;
+
+enum reStateType{
+    RS_CHAR,
+    RS_SPLIT,
+    RS_BOL,
+    RS_EOL,
+    RS_MATCH
+};
+
+typedef struct reState{
+    int type;
+    int out, out1;
+    unsigned char set[32];
+} reState;
+
+typedef struct reNfa{
+    reState *states;
+    int numStates, cap;
+    int start;
+} reNfa;
+
+typedef struct reDfa{
+    reNfa *nfa;
+    int unanchored;
+    int numStates, cap;
+    int *next;                  // cap * 256 transitions, -1 when not built yet
+    int *setOff, *setLen;       // NFA states of each DFA state, in pool
+    unsigned char *accept;      // contains a match
+    unsigned char *acceptEnd;   // contains a match if the line ends here
+    int *pool;
+    int poolLen, poolCap;
+    int *hash;                  // 2 * RE_MAX_DFA slots of state ids
+    int start[2];
+    unsigned int *mark;
+    unsigned int markGen;
+    int *stack, *buf, *buf2;
+} reDfa;
+
+typedef struct reSlot{
+    reDfa fwd, rev;
+    unsigned char *starts;
+    int startsCap;
+} reSlot;
+
+typedef struct reProg{
+    char *pattern;
+    reNfa fwd, rev;
+    reSlot *slots[RE_SLOTS];
+    unsigned int lastUse;
+} reProg;
+
+/* parser */
+
+int reNewNode(reParser *ps, int type){
+    if (ps->numNodes == ps->cap){
+        ps->cap = ps->cap ? ps->cap * 2 : 32;
+        ps->nodes = realloc(ps->nodes, sizeof(reNode) * ps->cap);
+    }
+    reNode *n = &ps->nodes[ps->numNodes];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return ps->numNodes++;
+}
+
+void reSetAdd(unsigned char *set, int c){
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+void reSetRange(unsigned char *set, int lo, int hi){
+    for (int c = lo; c <= hi; c++) reSetAdd(set, c);
+}
+
+void reSetInvert(unsigned char *set){
+    for (int i = 0; i < 32; i++) set[i] = ~set[i];
+}
+
+/* Adds the class for a backslash escape like \d to set. */
+void reEscape(unsigned char *set, char c){
+    unsigned char cls[32];
+    memset(cls, 0, sizeof(cls));
+
+    switch (tolower((unsigned char)c)){
+        case 'd':
+            reSetRange(cls, '0', '9');
+            break;
+        case 'w':
+            reSetRange(cls, 'a', 'z');
+            reSetRange(cls, 'A', 'Z');
+            reSetRange(cls, '0', '9');
+            reSetAdd(cls, '_');
+            break;
+        case 's':
+            reSetAdd(cls, ' ');
+            reSetRange(cls, '\t', '\r');
+            break;
+        default:
+            reSetAdd(set, c == 't' ? '\t' : (unsigned char)c);
+            return;
+    }
+
+    if (isupper((unsigned char)c)) reSetInvert(cls);
+    for (int i = 0; i < 32; i++) set[i] |= cls[i];
+}
+
+int reParseAlt(reParser *ps);
+
+int reParseClass(reParser *ps){
+    int id = reNewNode(ps, RN_SET);
+    unsigned char set[32];
+    memset(set, 0, sizeof(set));
+
+    int negate = 0;
+    if (*ps->p == '^'){
+        negate = 1;
+        ps->p++;
+    }
+
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)){
+        first = 0;
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && *ps->p){
+            char e = *ps->p++;
+            if (strchr("dDwWsS", e)){
+                reEscape(set, e);
+                continue;
+            }
+            lo = e == 't' ? '\t' : (unsigned char)e;
+        }
+
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']'){
+            ps->p++;
+            hi = (unsigned char)*ps->p++;
+            if (hi == '\\' && *ps->p) hi = (unsigned char)*ps->p++;
+        }
+        if (hi < lo){
+            ps->err = "bad range";
+            return -1;
+        }
+        reSetRange(set, lo, hi);
+    }
+
+    if (*ps->p != ']'){
+        ps->err = "missing ]";
+        return -1;
+    }
+    ps->p++;
+
+    if (negate) reSetInvert(set);
+    memcpy(ps->nodes[id].set, set, sizeof(set));
+    return id;
+}
+
+int reParseAtom(reParser *ps){
+    char c = *ps->p++;
+    int id;
+
+    switch (c){
+        case '(':
+            id = reParseAlt(ps);
+            if (id < 0) return -1;
+            if (*ps->p != ')'){
+                ps->err = "missing )";
+                return -1;
+            }
+            ps->p++;
+            return id;
+        case '[':
+            return reParseClass(ps);
+        case '.':
+            id = reNewNode(ps, RN_SET);
+            memset(ps->nodes[id].set, 0xff, 32);
+            return id;
+        case '^':
+            return reNewNode(ps, RN_BOL);
+        case '$':
+            return reNewNode(ps, RN_EOL);
+        case '\\':
+            if (*ps->p == '\0'){
+                ps->err = "trailing \\";
+                return -1;
+            }
+            id = reNewNode(ps, RN_SET);
+            reEscape(ps->nodes[id].set, *ps->p++);
+            return id;
+        case '*': case '+': case '?': case '{':
+            ps->err = "nothing to repeat";
+            return -1;
+        default:
+            id = reNewNode(ps, RN_SET);
+            reSetAdd(ps->nodes[id].set, (unsigned char)c);
+            return id;
+    }
+}
+
+/* Reads {m}, {m,} or {m,n}. A '{' that does not start one is a literal. */
+int reParseBraces(reParser *ps, int *min, int *max){
+    const char *p = ps->p + 1;
+    if (!isdigit((unsigned char)*p)) return 0;
+
+    *min = strtol(p, (char **)&p, 10);
+    *max = *min;
+    if (*p == ','){
+        p++;
+        *max = isdigit((unsigned char)*p) ? strtol(p, (char **)&p, 10) : -1;
+    }
+    if (*p != '}') return 0;
+
+    ps->p = p + 1;
+    return 1;
+}
+
+int reParseRepeat(reParser *ps){
+    int id = reParseAtom(ps);
+    if (id < 0) return -1;
+
+    while (1){
+        int min, max;
+        char c = *ps->p;
+        if (c == '*'){ min = 0; max = -1; ps->p++; }
+        else if (c == '+'){ min = 1; max = -1; ps->p++; }
+        else if (c == '?'){ min = 0; max = 1; ps->p++; }
+        else if (c == '{' && reParseBraces(ps, &min, &max)){
+            if (min > RE_MAX_REPEAT || max > RE_MAX_REPEAT || (max != -1 && max < min)){
+                ps->err = "bad repeat count";
+                return -1;
+            }
+        } else break;
+
+        int rep = reNewNode(ps, RN_REPEAT);
+        ps->nodes[rep].a = id;
+        ps->nodes[rep].min = min;
+        ps->nodes[rep].max = max;
+        id = rep;
+    }
+
+    return id;
+}
+
+int reParseConcat(reParser *ps){
+    int id = reNewNode(ps, RN_EMPTY);
+
+    while (*ps->p && *ps->p != '|' && *ps->p != ')'){
+        int next = reParseRepeat(ps);
+        if (next < 0) return -1;
+
+        int cat = reNewNode(ps, RN_CAT);
+        ps->nodes[cat].a = id;
+        ps->nodes[cat].b = next;
+        id = cat;
+    }
+
+    return id;
+}
+
+int reParseAlt(reParser *ps){
+    int id = reParseConcat(ps);
+
+    while (id >= 0 && *ps->p == '|'){
+        ps->p++;
+        int other = reParseConcat(ps);
+        if (other < 0) return -1;
+
+        int alt = reNewNode(ps, RN_ALT);
+        ps->nodes[alt].a = id;
+        ps->nodes[alt].b = other;
+        id = alt;
+    }
+
+    return id;
+}
+
+/* NFA construction */
+
+int reNfaAdd(reNfa *nfa, int type, int out, int out1, const unsigned char *set){
+    if (nfa->numStates == nfa->cap){
+        nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+        nfa->states = realloc(nfa->states, sizeof(reState) * nfa->cap);
+    }
+
+    reState *s = &nfa->states[nfa->numStates];
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    if (set) memcpy(s->set, set, 32);
+    return nfa->numStates++;
+}
+
+/* Compiles node 'id' so that it continues into state 'next' and returns its
+ * entry state. With 'reversed' set the pattern is built to match reversed
+ * text: concatenations swap order and ^ and $ swap roles. */
+int reCompileNode(reNfa *nfa, reNode *nodes, int id, int next, int reversed){
+    if (nfa->numStates > RE_MAX_NFA) return next;
+
+    reNode *n = &nodes[id];
+    switch (n->type){
+        case RN_SET:
+            return reNfaAdd(nfa, RS_CHAR, next, -1, n->set);
+        case RN_EMPTY:
+            return next;
+        case RN_CAT:
+            if (reversed)
+                return reCompileNode(nfa, nodes, n->b,
+                                     reCompileNode(nfa, nodes, n->a, next, reversed), reversed);
+            return reCompileNode(nfa, nodes, n->a,
+                                 reCompileNode(nfa, nodes, n->b, next, reversed), reversed);
+        case RN_ALT: {
+            int a = reCompileNode(nfa, nodes, n->a, next, reversed);
+            int b = reCompileNode(nfa, nodes, n->b, next, reversed);
+            return reNfaAdd(nfa, RS_SPLIT, a, b, NULL);
+        }
+        case RN_REPEAT: {
+            int entry = next;
+            if (n->max == -1){
+                int loop = reNfaAdd(nfa, RS_SPLIT, -1, next, NULL);
+                int body = reCompileNode(nfa, nodes, n->a, loop, reversed);
+                nfa->states[loop].out = body;
+                entry = loop;
+            } else {
+                for (int k = n->min; k < n->max; k++){
+                    int body = reCompileNode(nfa, nodes, n->a, entry, reversed);
+                    entry = reNfaAdd(nfa, RS_SPLIT, body, entry, NULL);
+                }
+            }
+            for (int k = 0; k < n->min; k++)
+                entry = reCompileNode(nfa, nodes, n->a, entry, reversed);
+            return entry;
+        }
+        case RN_BOL:
+            return reNfaAdd(nfa, reversed ? RS_EOL : RS_BOL, next, -1, NULL);
+        case RN_EOL:
+            return reNfaAdd(nfa, reversed ? RS_BOL : RS_EOL, next, -1, NULL);
+    }
+
+    return next;
+}
+
+/* lazy DFA */
+
+void reDfaInit(reDfa *d, reNfa *nfa, int unanchored){
+    memset(d, 0, sizeof(*d));
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->hash = malloc(sizeof(int) * 2 * RE_MAX_DFA);
+    for (int i = 0; i < 2 * RE_MAX_DFA; i++) d->hash[i] = -1;
+    d->start[0] = d->start[1] = -1;
+    d->mark = calloc(nfa->numStates, sizeof(unsigned int));
+    d->stack = malloc(sizeof(int) * (nfa->numStates * 2 + 1));
+    d->buf = malloc(sizeof(int) * nfa->numStates);
+    d->buf2 = malloc(sizeof(int) * nfa->numStates);
+}
+
+void reDfaFree(reDfa *d){
+    free(d->next);
+    free(d->setOff);
+    free(d->setLen);
+    free(d->accept);
+    free(d->acceptEnd);
+    free(d->pool);
+    free(d->hash);
+    free(d->mark);
+    free(d->stack);
+    free(d->buf);
+    free(d->buf2);
+}
+
+/* Adds the states reachable from s without consuming input to set. Only
+ * character, $ and match states are kept; they are all a DFA state needs. */
+void reClosure(reDfa *d, int s, int atStart, int *set, int *n){
+    reState *states = d->nfa->states;
+    int sp = 0;
+    d->stack[sp++] = s;
+
+    while (sp){
+        int x = d->stack[--sp];
+        if (d->mark[x] == d->markGen) continue;
+        d->mark[x] = d->markGen;
+
+        switch (states[x].type){
+            case RS_CHAR:
+            case RS_EOL:
+            case RS_MATCH:
+                set[(*n)++] = x;
+                break;
+            case RS_SPLIT:
+                d->stack[sp++] = states[x].out1;
+                d->stack[sp++] = states[x].out;
+                break;
+            case RS_BOL:
+                if (atStart) d->stack[sp++] = states[x].out;
+                break;
+        }
+    }
+}
+
+void reNextGen(reDfa *d){
+    if (++d->markGen == 0){
+        memset(d->mark, 0, sizeof(unsigned int) * d->nfa->numStates);
+        d->markGen = 1;
+    }
+}
+
+int reCmpInt(const void *a, const void *b){
+    return *(const int *)a - *(const int *)b;
+}
+
+unsigned int reHashSet(int *set, int n){
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < n; i++){
+        h ^= (unsigned int)set[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void reDfaFlush(reDfa *d){
+    d->numStates = 0;
+    d->poolLen = 0;
+    for (int i = 0; i < 2 * RE_MAX_DFA; i++) d->hash[i] = -1;
+    d->start[0] = d->start[1] = -1;
+}
+
+/* Returns the DFA state for a sorted set of NFA states, creating it if
+ * needed. Sets *flushed when the cache had to be emptied to make room. */
+int reDfaState(reDfa *d, int *set, int n, int *flushed){
+    unsigned int h = reHashSet(set, n);
+    unsigned int slot = h % (2 * RE_MAX_DFA);
+
+    for (; d->hash[slot] != -1; slot = (slot + 1) % (2 * RE_MAX_DFA)){
+        int id = d->hash[slot];
+        if (d->setLen[id] == n && memcmp(&d->pool[d->setOff[id]], set, sizeof(int) * n) == 0)
+            return id;
+    }
+
+    if (d->numStates == RE_MAX_DFA){
+        reDfaFlush(d);
+        *flushed = 1;
+        return reDfaState(d, set, n, flushed);
+    }
+
+    if (d->numStates == d->cap){
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->next = realloc(d->next, sizeof(int) * 256 * d->cap);
+        d->setOff = realloc(d->setOff, sizeof(int) * d->cap);
+        d->setLen = realloc(d->setLen, sizeof(int) * d->cap);
+        d->accept = realloc(d->accept, d->cap);
+        d->acceptEnd = realloc(d->acceptEnd, d->cap);
+    }
+    if (d->poolLen + n > d->poolCap){
+        while (d->poolLen + n > d->poolCap) d->poolCap = d->poolCap ? d->poolCap * 2 : 256;
+        d->pool = realloc(d->pool, sizeof(int) * d->poolCap);
+    }
+
+    int id = d->numStates++;
+    d->setOff[id] = d->poolLen;
+    d->setLen[id] = n;
+    memcpy(&d->pool[d->poolLen], set, sizeof(int) * n);
+    d->poolLen += n;
+    for (int c = 0; c < 256; c++) d->next[id * 256 + c] = -1;
+
+    reState *states = d->nfa->states;
+    int accept = 0, acceptEnd = 0;
+    int m = 0;
+    reNextGen(d);
+    for (int i = 0; i < n; i++){
+        if (states[set[i]].type == RS_MATCH) accept = 1;
+        else if (states[set[i]].type == RS_EOL) reClosure(d, states[set[i]].out, 0, d->buf2, &m);
+    }
+    for (int i = 0; i < m; i++)
+        if (states[d->buf2[i]].type == RS_MATCH) acceptEnd = 1;
+
+    d->accept[id] = accept;
+    d->acceptEnd[id] = accept || acceptEnd;
+    d->hash[slot] = id;
+    return id;
+}
+
+int reDfaStart(reDfa *d, int atStart){
+    if (d->start[atStart] != -1) return d->start[atStart];
+
+    int n = 0, flushed = 0;
+    reNextGen(d);
+    reClosure(d, d->nfa->start, atStart, d->buf, &n);
+    qsort(d->buf, n, sizeof(int), reCmpInt);
+    int id = reDfaState(d, d->buf, n, &flushed);
+    d->start[atStart] = id;
+    return id;
+}
+
+int reDfaStep(reDfa *d, int s, unsigned char c){
+    int t = d->next[s * 256 + c];
+    if (t >= 0) return t;
+
+    reState *states = d->nfa->states;
+    int *set = &d->pool[d->setOff[s]];
+    int len = d->setLen[s];
+    int n = 0;
+
+    reNextGen(d);
+    for (int i = 0; i < len; i++){
+        reState *st = &states[set[i]];
+        if (st->type == RS_CHAR && (st->set[c >> 3] & (1 << (c & 7))))
+            reClosure(d, st->out, 0, d->buf, &n);
+    }
+    if (d->unanchored) reClosure(d, d->nfa->start, 0, d->buf, &n);
+    qsort(d->buf, n, sizeof(int), reCmpInt);
+
+    int flushed = 0;
+    t = reDfaState(d, d->buf, n, &flushed);
+    if (!flushed) d->next[s * 256 + c] = t;
+    return t;
+}
+
+/* compiled pattern cache */
+
+reProg *reCache[RE_CACHE];
+unsigned int reClock;
+
+void reProgFree(reProg *prog){
+    for (int i = 0; i < RE_SLOTS; i++){
+        if (prog->slots[i] == NULL) continue;
+        reDfaFree(&prog->slots[i]->fwd);
+        reDfaFree(&prog->slots[i]->rev);
+        free(prog->slots[i]->starts);
+        free(prog->slots[i]);
+    }
+    free(prog->fwd.states);
+    free(prog->rev.states);
+    free(prog->pattern);
+    free(prog);
+}
+
+/* Returns the compiled program for pattern, from the cache if it was used
+ * recently, or NULL with *err set if it does not parse. */
+reProg *reCompile(const char *pattern, const char **err){
+    int victim = 0;
+    for (int i = 0; i < RE_CACHE; i++){
+        if (reCache[i] && strcmp(reCache[i]->pattern, pattern) == 0){
+            reCache[i]->lastUse = ++reClock;
+            return reCache[i];
+        }
+        if (reCache[victim] && (reCache[i] == NULL || reCache[i]->lastUse < reCache[victim]->lastUse))
+            victim = i;
+    }
+
+    reParser ps = {pattern, NULL, 0, 0, NULL};
+    int root = reParseAlt(&ps);
+    if (root >= 0 && *ps.p == ')') ps.err = "unmatched )";
+    if (root < 0 || ps.err){
+        *err = ps.err;
+        free(ps.nodes);
+        return NULL;
+    }
+
+    reProg *prog = calloc(1, sizeof(reProg));
+    prog->fwd.start = reCompileNode(&prog->fwd, ps.nodes, root,
+                                    reNfaAdd(&prog->fwd, RS_MATCH, -1, -1, NULL), 0);
+    prog->rev.start = reCompileNode(&prog->rev, ps.nodes, root,
+                                    reNfaAdd(&prog->rev, RS_MATCH, -1, -1, NULL), 1);
+    free(ps.nodes);
+
+    if (prog->fwd.numStates > RE_MAX_NFA || prog->rev.numStates > RE_MAX_NFA){
+        *err = "pattern too large";
+        reProgFree(prog);
+        return NULL;
+    }
+
+    prog->pattern = strdup(pattern);
+    prog->lastUse = ++reClock;
+    if (reCache[victim]) reProgFree(reCache[victim]);
+    reCache[victim] = prog;
+    return prog;
+}
+
+reSlot *reGetSlot(reProg *prog, int slot){
+    if (prog->slots[slot] == NULL){
+        reSlot *s = calloc(1, sizeof(reSlot));
+        reDfaInit(&s->fwd, &prog->fwd, 0);
+        reDfaInit(&s->rev, &prog->rev, 1);
+        prog->slots[slot] = s;
+    }
+    return prog->slots[slot];
+}
+
+/* matching */
+
+typedef struct reIter{
+    reSlot *slot;
+    const unsigned char *text;
+    int n;
+    int pos;
+    long budget;
+    const int *cancel;  // stops the scan once set, or NULL
+} reIter;
+
+int reCancelled(const int *cancel, long i){
+    return cancel && (i & (KILO_FIND_CANCEL - 1)) == 0 && __atomic_load_n(cancel, __ATOMIC_RELAXED);
+}
+
+/* Marks every position of text a match can start at, using the slot's
+ * scratch buffer. */
+void reIterBegin(reIter *it, reProg *prog, int slot, const char *text, int n, const int *cancel){
+    reSlot *s = reGetSlot(prog, slot);
+    if (n + 1 > s->startsCap){
+        s->startsCap = n + 1 > 64 ? n + 1 : 64;
+        s->starts = realloc(s->starts, s->startsCap);
+    }
+
+    it->slot = s;
+    it->text = (const unsigned char *)text;
+    it->n = n;
+    it->pos = 0;
+    it->budget = 4 * (long)n + 256;
+    it->cancel = cancel;
+
+    reDfa *d = &s->rev;
+    int st = reDfaStart(d, 1);
+    s->starts[n] = n == 0 ? d->acceptEnd[st] : d->accept[st];
+    for (int i = n - 1; i >= 0; i--){
+        if (reCancelled(cancel, i)){
+            it->pos = n + 1;
+            return;
+        }
+        st = reDfaStep(d, st, it->text[i]);
+        s->starts[i] = i == 0 ? d->acceptEnd[st] : d->accept[st];
+    }
+}
+
+/* Returns the next non-overlapping match as [*start, *end). Matches are
+ * extended to their longest end until the row's step budget runs out, then
+ * cut at their shortest, which keeps the whole row linear. */
+int reIterNext(reIter *it, int *start, int *end){
+    unsigned char *starts = it->slot->starts;
+    while (it->pos <= it->n && !starts[it->pos]) it->pos++;
+    if (it->pos > it->n) return 0;
+
+    int s = it->pos;
+    reDfa *d = &it->slot->fwd;
+    int st = reDfaStart(d, s == 0);
+    int last = (s == it->n ? d->acceptEnd[st] : d->accept[st]) ? s : -1;
+    int shortest = it->budget <= 0;
+
+    for (int i = s; i < it->n && !(shortest && last != -1); i++){
+        if (reCancelled(it->cancel, i - s + 1)){
+            it->pos = it->n + 1;
+            return 0;
+        }
+        st = reDfaStep(d, st, it->text[i]);
+        if (d->setLen[st] == 0) break;
+        if (i + 1 == it->n ? d->acceptEnd[st] : d->accept[st]) last = i + 1;
+        if (--it->budget <= 0) shortest = 1;
+    }
+
+    if (last < s) last = s;
+    *start = s;
+    *end = last;
+    it->pos = last > s ? last : s + 1;
+    return 1;
+}
+
+/*** find ***/
+
+/* Literal search kernel. The vector versions compare the first and last
+ * byte of the needle against a block of candidate positions at once and
+ * only run memcmp on positions where both agree. */
+
+const char *findMemmemScalar(const char *hay, size_t n, const char *needle, size_t m){
+    if (m > n) return NULL;
+    const char *p = hay, *last = hay + n - m;
+    while (p <= last){
+        p = memchr(p, needle[0], last - p + 1);
+        if (p == NULL) return NULL;
+        if (memcmp(p + 1, needle + 1, m - 1) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#if defined(__SSE2__)
+const char *findMemmemSse2(const char *hay, size_t n, const char *needle, size_t m){
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[m-1]);
+
+    size_t i = 0;
+    for (; i + m + 15 <= n; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while (mask){
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    return findMemmemScalar(hay + i, n - i, needle, m);
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+const char *findMemmemAvx2(const char *hay, size_t n, const char *needle, size_t m){
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[m-1]);
+
+    size_t i = 0;
+    for (; i + m + 31 <= n; i += 32){
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        while (mask){
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    return findMemmemScalar(hay + i, n - i, needle, m);
+}
+#endif
+
+const char *(*findMemmemKernel)(const char *, size_t, const char *, size_t) = findMemmemScalar;
+
+void findInit(){
+#if defined(__SSE2__)
+    findMemmemKernel = findMemmemSse2;
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) findMemmemKernel = findMemmemAvx2;
+#endif
+}
+
+const char *findMemmem(const char *hay, size_t n, const char *needle, size_t m){
+    if (m == 0) return hay;
+    if (m > n) return NULL;
+    if (m == 1) return memchr(hay, needle[0], n);
+    return findMemmemKernel(hay, n, needle, m);
+}
+
+/* What a query matches with: the literal kernels above, or a compiled
+ * pattern when regex search is on. 'slot' picks the per-thread DFA cache a
+ * pattern uses, so workers can share one program. */
+typedef struct findMatcher{
+    const char *lit;
+    int litLen;
+    reProg *re;
+} findMatcher;
+
+typedef struct findIter{
+    findMatcher *m;
+    editorRow *eRow;
+    const char *p;
+    const int *cancel;
+    reIter re;
+} findIter;
+
+int findMatcherInit(findMatcher *m, const char *query){
+    m->lit = query;
+    m->litLen = strlen(query);
+    m->re = NULL;
+    if (!conf.findRegex) return 0;
+
+    m->re = reCompile(query, &conf.findError);
+    return m->re ? 0 : -1;
+}
+
+void findIterBegin(findIter *it, findMatcher *m, int slot, editorRow *eRow, const int *cancel){
+    it->m = m;
+    it->eRow = eRow;
+    it->p = eRow->text;
+    it->cancel = cancel;
+    if (m->re) reIterBegin(&it->re, m->re, slot, eRow->text, eRow->tSize, cancel);
+}
+
+/* Column of the next match in the row, or -1. Literal matches may overlap,
+ * pattern matches do not. With a cancel flag, long rows are searched a
+ * window at a time and the search gives up once the flag is set. */
+int findIterNext(findIter *it){
+    if (it->m->re){
+        int start, end;
+        return reIterNext(&it->re, &start, &end) ? start : -1;
+    }
+
+    const char *end = it->eRow->text + it->eRow->tSize;
+    int window = KILO_FIND_CANCEL + it->m->litLen - 1;
+    while (it->cancel && end - it->p > window){
+        if (__atomic_load_n(it->cancel, __ATOMIC_RELAXED)) return -1;
+        const char *p = findMemmem(it->p, window, it->m->lit, it->m->litLen);
+        if (p){
+            it->p = p + 1;
+            return p - it->eRow->text;
+        }
+        it->p += KILO_FIND_CANCEL;
+    }
+    const char *p = findMemmem(it->p, end - it->p, it->m->lit, it->m->litLen);
+    if (p == NULL) return -1;
+    it->p = p + 1;
+    return p - it->eRow->text;
+}
+
+int findCountRow(findMatcher *m, int slot, editorRow *eRow, const int *cancel){
+    findIter it;
+    int count = 0;
+    findIterBegin(&it, m, slot, eRow, cancel);
+    while (findIterNext(&it) != -1) count++;
+    return count;
+}
+
+/* Every query typed at the prompt leaves a level holding the rows that
+ * contain it and how many times. When the next query contains the previous
+ * one, only that level's rows need to be scanned again; backspacing pops
+ * back to the level that still applies. */
+typedef struct findLevel{
+    char *query;
+    int *rows;
+    int *counts;
+    int numRows;
+    long long total;
+    int complete;
+} findLevel;
+
+struct findState{
+    findLevel *levels;
+    int depth;
+    int cap;
+    int lastRow, lastCol;
+    int direction;
+} findState;
+
+void findLevelFree(findLevel *lvl){
+    free(lvl->query);
+    free(lvl->rows);
+    free(lvl->counts);
+}
+
+void findLevelAdd(findLevel *lvl, int at, int count, int *cap){
+    if (lvl->numRows == *cap){
+        *cap = *cap ? *cap * 2 : 256;
+        lvl->rows = realloc(lvl->rows, sizeof(int) * *cap);
+        lvl->counts = realloc(lvl->counts, sizeof(int) * *cap);
+    }
+    lvl->rows[lvl->numRows] = at;
+    lvl->counts[lvl->numRows] = count;
+    lvl->numRows++;
+    lvl->total += count;
+}
+
+/* A level is filled by a scan job split into chunks of KILO_FIND_CHUNK rows
+ * (or candidate rows) that the worker pool picks up in order. Finished
+ * chunks wake the UI through conf.wakeFd, which folds them into the match
+ * count and shows the first match found so far. Typing again cancels the
+ * job; workers check for that every few hundred rows, and every few MB
+ * within a long row. */
+typedef struct findChunk{
+    findLevel res;
+    int first, last;
+    int done;
+    int merged;
+} findChunk;
+
+typedef struct findJob{
+    findMatcher m;
+    int *fromRows;      // candidate rows to rescan, or NULL for every row
+    findChunk *chunks;
+    int numChunks;
+    int nextChunk;
+    int doneChunks;
+    int shown;          // chunk holding the match on screen, or -1
+    int cancel;
+} findJob;
+
+struct findPool{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int numThreads;
+    int busy;           // workers inside a chunk
+    findJob *job;
+} findPool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, NULL};
+
+void findScanChunk(findJob *job, findChunk *chunk, int slot){
+    int cap = 0;
+
+    if (job->fromRows == NULL){
+        int at = chunk->first, off;
+        int b = blockFind(at, &off);
+        for (; at < chunk->last; b++, off = 0){
+            rowBlock *blk = &conf.blocks[b];
+            for (; off < blk->numRows && at < chunk->last; off++, at++){
+                if ((at & 255) == 0 && __atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) return;
+                int count = findCountRow(&job->m, slot, &blk->rows[off], &job->cancel);
+                if (count) findLevelAdd(&chunk->res, at, count, &cap);
+            }
+            if (mem.limit) memDropBlock(blk);
+        }
+    } else {
+        rowBlock *prev = NULL;
+        for (int k = chunk->first; k < chunk->last; k++){
+            if ((k & 255) == 0 && __atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) return;
+            int at = job->fromRows[k], off;
+            rowBlock *blk = &conf.blocks[blockFind(at, &off)];
+            if (mem.limit && prev && prev != blk) memDropBlock(prev);
+            prev = blk;
+            int count = findCountRow(&job->m, slot, &blk->rows[off], &job->cancel);
+            if (count) findLevelAdd(&chunk->res, at, count, &cap);
+        }
+        if (mem.limit && prev) memDropBlock(prev);
+    }
+}
+
+void *findWorker(void *arg){
+    int slot = (long)arg;
+
+    pthread_mutex_lock(&findPool.lock);
+    while (1){
+        findJob *job = findPool.job;
+        if (job == NULL || job->cancel || job->nextChunk == job->numChunks){
+            pthread_cond_wait(&findPool.cond, &findPool.lock);
+            continue;
+        }
+
+        findChunk *chunk = &job->chunks[job->nextChunk++];
+        findPool.busy++;
+        pthread_mutex_unlock(&findPool.lock);
+
+        long long start = perfBegin();
+        findScanChunk(job, chunk, slot);
+        if (start) perfTrace(PERF_SEARCH, slot + 1, start, perfNow() - start);
+
+        pthread_mutex_lock(&findPool.lock);
+        findPool.busy--;
+        if (!job->cancel){
+            chunk->done = 1;
+            job->doneChunks++;
+            editorWake();
+        }
+        pthread_cond_broadcast(&findPool.cond);
+    }
+
+    return NULL;
+}
 
-    conf.eRow = realloc(conf.eRow, sizeof(editorRow) * (conf.numRows+1));
-    memmove(&conf.eRow[at+1], &conf.eRow[at], sizeof(editorRow) * (conf.numRows - at));
+void findPoolStart(){
+    if (findPool.numThreads) return;
 
-    conf.eRow[at].tSize = len;
-    conf.eRow[at].text = malloc(len + 1);
-    memcpy(conf.eRow[at].text, s, len);
-    conf.eRow[at].text[len] = '\0';
-    
-    conf.eRow[at].rSize = 0;
-    conf.eRow[at].render = NULL;
-    editorUpdateRow(&conf.eRow[at]);
-    
-    conf.numRows++;
-    conf.dirty++;
-}
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > KILO_MAX_WORKERS) n = KILO_MAX_WORKERS;
 
-void editorFreeRow(editorRow *eRow){
-    free(eRow->text);
-    free(eRow->render);
+    for (int i = 0; i < n; i++){
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, findWorker, (void *)(long)(i + 1)) != 0) break;
+        pthread_detach(tid);
+        findPool.numThreads++;
+    }
+    if (findPool.numThreads == 0) die("pthread_create");
 }
 
-void editorDelRow(int at){
-    if (at < 0 || at >= conf.numRows) return;
-    editorFreeRow(&conf.eRow[at]);
-    memmove(&conf.eRow[at], &conf.eRow[at+1], sizeof(editorRow)*(conf.numRows - at - 1));
-    conf.numRows--;
-    conf.dirty++;
+void findJobFree(findJob *job){
+    for (int c = 0; c < job->numChunks; c++){
+        free(job->chunks[c].res.rows);
+        free(job->chunks[c].res.counts);
+    }
+    free(job->chunks);
+    free(job);
 }
 
-void editorRowInsertChar(editorRow *erow, int at, int c){
-    if (at < 0 || at > erow->tSize) at = erow->tSize;
-    erow->text = realloc(erow->text, erow->tSize + 2);
-    memmove(&erow->text[at+1], &erow->text[at], erow->tSize - at + 1);
-    erow->tSize++;
-    erow->text[at] = c;
-    editorUpdateRow(erow);
+/* Stops the running job, waiting only for workers to notice, and drops the
+ * level it was filling. */
+void findCancel(){
+    findJob *job = findPool.job;
+    if (job == NULL) return;
+
+    pthread_mutex_lock(&findPool.lock);
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    while (findPool.busy)
+        pthread_cond_wait(&findPool.cond, &findPool.lock);
+    findPool.job = NULL;
+    pthread_mutex_unlock(&findPool.lock);
+
+    findJobFree(job);
+    findLevelFree(&findState.levels[--findState.depth]);
+    conf.findBusy = 0;
 }
 
-void editorRowAppendString(editorRow *eRow, char *s, size_t len){
-    eRow->text = realloc(eRow->text, eRow->tSize + len + 1);
-    memcpy(&eRow->text[eRow->tSize], s, len);
-    eRow->tSize += len;
-    eRow->text[eRow->tSize] = '\0';
-    editorUpdateRow(eRow);
-    conf.dirty++;
+void findStart(findLevel *lvl, findLevel *from){
+    int n = from ? from->numRows : conf.numRows;
+
+    findJob *job = calloc(1, sizeof(findJob));
+    findMatcherInit(&job->m, lvl->query);
+    job->fromRows = from ? from->rows : NULL;
+    job->numChunks = (n + KILO_FIND_CHUNK - 1) / KILO_FIND_CHUNK;
+    job->chunks = calloc(job->numChunks ? job->numChunks : 1, sizeof(findChunk));
+    for (int c = 0; c < job->numChunks; c++){
+        job->chunks[c].first = c * KILO_FIND_CHUNK;
+        job->chunks[c].last = n < (c + 1) * KILO_FIND_CHUNK ? n : (c + 1) * KILO_FIND_CHUNK;
+    }
+    job->shown = -1;
+
+    findPoolStart();
+    pthread_mutex_lock(&findPool.lock);
+    findPool.job = job;
+    pthread_cond_broadcast(&findPool.cond);
+    pthread_mutex_unlock(&findPool.lock);
+    conf.findBusy = 1;
 }
 
-void editorRowDelChar(editorRow *eRow, int at){
-    if (at < 0 || at >= eRow->rSize) return;
-    memmove(&eRow->text[at], &eRow->text[at+1], eRow->tSize - at);
-    eRow->tSize--;
-    editorUpdateRow(eRow);
-    conf.dirty++;
-}
+/* Patterns cannot be narrowed like literals, so in regex mode only an
+ * identical query reuses a level. */
+findLevel *findSetQuery(char *query){
+    while (findState.depth > 0){
+        char *prev = findState.levels[findState.depth - 1].query;
+        if (conf.findRegex ? strcmp(query, prev) == 0 : strstr(query, prev) != NULL) break;
+        findLevelFree(&findState.levels[--findState.depth]);
+    }
 
-/*** editor operations ***/
+    if (findState.depth && strcmp(findState.levels[findState.depth - 1].query, query) == 0)
+        return &findState.levels[findState.depth - 1];
 
-void editorInsertChar(int c){
-    if (conf.cY == conf.numRows)
-        editorInsertRow(conf.numRows, "", 0);
+    if (findState.depth == findState.cap){
+        findState.cap = findState.cap ? findState.cap * 2 : 8;
+        findState.levels = realloc(findState.levels, sizeof(findLevel) * findState.cap);
+    }
 
-    editorRowInsertChar(&conf.eRow[conf.cY], conf.cX, c);
-    conf.cX++;
+    findLevel *from = findState.depth ? &findState.levels[findState.depth - 1] : NULL;
+    findLevel *lvl = &findState.levels[findState.depth++];
+    memset(lvl, 0, sizeof(*lvl));
+    lvl->query = strdup(query);
+    findStart(lvl, from);
+    return lvl;
 }
 
-void editorInsertNewLine(){
-    if (conf.cX == 0)
-        editorInsertRow(conf.cY, "", 0);
-    else {
-        editorRow *eRow = &conf.eRow[conf.cY];
-        editorInsertRow(conf.cY+1, &eRow->text[conf.cX], eRow->tSize - conf.cX);
-        eRow = &conf.eRow[conf.cY];
-        eRow->tSize = conf.cX;
-        eRow->text[eRow->tSize] = '\0';
-        editorUpdateRow(eRow);
-    }
-    conf.cY++;
-    conf.cX = 0;
+void findReset(){
+    findCancel();
+    while (findState.depth > 0)
+        findLevelFree(&findState.levels[--findState.depth]);
+    findState.lastRow = -1;
+    findState.lastCol = -1;
+    findState.direction = 1;
+    conf.findTotal = 0;
+    conf.findIndex = 0;
+    conf.findError = NULL;
 }
 
-void editorDelChar(){
-    if (conf.cY == conf.numRows) return;
-    if (conf.cX == 0 && conf.cY == 0) return;
+/* Index of the first candidate row at or after 'at'. */
+int findLowerBound(findLevel *lvl, int at){
+    int lo = 0, hi = lvl->numRows;
+    while (lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if (lvl->rows[mid] < at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
+/* Column of the match in 'eRow' that comes after col (dir 1) or before it
+ * (dir -1), or -1 if there is none. */
+int findInRow(findMatcher *m, editorRow *eRow, int col, int dir){
+    if (dir > 0 && m->re == NULL){
+        int from = col + 1;
+        if (from > eRow->tSize) return -1;
+        const char *p = findMemmem(eRow->text + from, eRow->tSize - from, m->lit, m->litLen);
+        return p ? p - eRow->text : -1;
+    }
 
-    editorRow *eRow = &conf.eRow[conf.cY];
-    if (conf.cX > 0){
-        editorRowDelChar(eRow, conf.cX - 1);
-        conf.cX--;
-    } else {
-        conf.cX = conf.eRow[conf.cY - 1].tSize;
-        editorRowAppendString(&conf.eRow[conf.cY-1], eRow->text, eRow->tSize);
-        editorDelRow(conf.cY);
-        conf.cY--;
+    findIter it;
+    int best = -1, at;
+    findIterBegin(&it, m, 0, eRow, NULL);
+    while ((at = findIterNext(&it)) != -1){
+        if (dir > 0 && at > col) return at;
+        if (dir < 0){
+            if (at >= col) break;
+            best = at;
+        }
     }
+    return best;
 }
 
-/*** file i/o ***/
+/* Moves the cursor to the nearest match from (lastRow, lastCol) in the
+ * current direction and works out its position among all matches. */
+void findStep(findLevel *lvl){
+    if (lvl->numRows == 0) return;
+
+    findMatcher m;
+    findMatcherInit(&m, lvl->query);
+    int dir = findState.direction;
+    int k = findLowerBound(lvl, findState.lastRow);
+    int col = -1;
+
+    if (k < lvl->numRows && lvl->rows[k] == findState.lastRow)
+        col = findInRow(&m, editorRowAt(lvl->rows[k]), findState.lastCol, dir);
+
+    if (col == -1){
+        if (dir > 0){
+            if (k < lvl->numRows && lvl->rows[k] == findState.lastRow) k++;
+            if (k == lvl->numRows) k = 0;
+            col = findInRow(&m, editorRowAt(lvl->rows[k]), -1, 1);
+        } else {
+            k = (k == 0 ? lvl->numRows : k) - 1;
+            editorRow *eRow = editorRowAt(lvl->rows[k]);
+            col = findInRow(&m, eRow, eRow->tSize + 1, -1);
+        }
+    }
 
-char *editorRowsToString(int *buflen){
-    int totLen = 0;
-    for (int j = 0; j < conf.numRows; j++)
-        totLen += conf.eRow[j].tSize + 1;
-    *buflen = totLen;
+    findState.lastRow = lvl->rows[k];
+    findState.lastCol = col;
+    conf.cY = lvl->rows[k];
+    conf.cX = col;
+    conf.rowOff = conf.numRows;
 
-    char *buf = malloc(totLen);
-    char *p = buf;
+    long long index = 0;
+    for (int j = 0; j < k; j++) index += lvl->counts[j];
+    findIter it;
+    int at;
+    findIterBegin(&it, &m, 0, editorRowAt(lvl->rows[k]), NULL);
+    while ((at = findIterNext(&it)) != -1 && at <= col) index++;
 
-    for(int j = 0; j < conf.numRows; j++){
-        memcpy(p, conf.eRow[j].text, conf.eRow[j].tSize);
-        p += conf.eRow[j].tSize;
-        *p = '\n';
-        p++;
+    conf.findIndex = index;
+}
+
+/* Folds chunks finished since the last call into the match count, moves to
+ * the earliest match found so far, and turns the job into a complete level
+ * once every chunk is in. */
+void findPoll(){
+    findJob *job = findPool.job;
+    if (job == NULL) return;
+    findLevel *lvl = &findState.levels[findState.depth - 1];
+    long long start = perfBegin();
+
+    pthread_mutex_lock(&findPool.lock);
+    int allDone = job->doneChunks == job->numChunks;
+    for (int c = 0; c < job->numChunks; c++){
+        findChunk *chunk = &job->chunks[c];
+        if (!chunk->done || chunk->merged) continue;
+        chunk->merged = 1;
+        conf.findTotal += chunk->res.total;
+
+        if (chunk->res.numRows && (job->shown == -1 || c < job->shown)){
+            job->shown = c;
+            conf.cY = chunk->res.rows[0];
+            conf.cX = findInRow(&job->m, editorRowAt(conf.cY), -1, 1);
+            conf.rowOff = conf.numRows;
+        }
     }
+    pthread_mutex_unlock(&findPool.lock);
 
-    return buf;
-}
+    if (!allDone){
+        perfEnd(PERF_SEARCH, start);
+        return;
+    }
 
-void editorOpen(char *fileName){
-    free(conf.filename);
-    conf.filename = strdup(fileName);
-    
-    FILE *fp = fopen(fileName, "r");
-    if (!fp) die("fopen");
+    int cap = 0;
+    for (int c = 0; c < job->numChunks; c++){
+        findLevel *res = &job->chunks[c].res;
+        for (int k = 0; k < res->numRows; k++)
+            findLevelAdd(lvl, res->rows[k], res->counts[k], &cap);
+    }
+    lvl->complete = 1;
 
-    char *line = NULL;
-    size_t lineCap = 0;
-    ssize_t lineLen;
+    pthread_mutex_lock(&findPool.lock);
+    findPool.job = NULL;
+    pthread_mutex_unlock(&findPool.lock);
+    findJobFree(job);
+    conf.findBusy = 0;
 
-    while ((lineLen = getline(&line, &lineCap, fp)) != -1){
-        while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) 
-            lineLen--;
+    conf.findTotal = lvl->total;
+    findStep(lvl);
+    perfEnd(PERF_SEARCH, start);
+}
 
-        editorInsertRow(conf.numRows, line, lineLen);
+void editorFindCallback(char *query, int key){
+    if (key == '\r' || key == '\x1b'){
+        findReset();
+        return;
+    } else if (key == WAKE_KEY){
+        findPoll();
+        return;
     }
 
-    free(line);
-    fclose(fp); 
-    conf.dirty = 0;   
-}
+    if (key == CTRL_KEY('r')){
+        conf.findRegex = !conf.findRegex;
+        findReset();
+    }
 
-void editorSave(){
-    if (conf.filename == NULL){
-        conf.filename = editorPrompt("Save as: %s", NULL);
-        if (conf.filename == NULL){
-            editorSetStatusMessage("Save canceled");
-            return;
-        }
+    findLevel *top = findState.depth ? &findState.levels[findState.depth - 1] : NULL;
+
+    if (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP){
+        findState.direction = (key == ARROW_RIGHT || key == ARROW_DOWN) ? 1 : -1;
+        if (findState.lastRow == -1) findState.direction = 1;
+        if (top && top->complete) findStep(top);
+        return;
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
+    if (top && strcmp(top->query, query) == 0) return;
 
-    int fd = open(conf.filename, O_RDWR | O_CREAT, 0664);
-    if (fd != -1){
-        if (ftruncate(fd, len) != -1){
-            if (write(fd, buf, len) == len){
-                close(fd);
-                free(buf);
-                conf.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
-    }    
+    findCancel();
+    findState.lastRow = -1;
+    findState.lastCol = -1;
+    findState.direction = 1;
+    conf.findTotal = 0;
+    conf.findIndex = 0;
+    conf.findError = NULL;
+
+    if (query[0] == '\0'){
+        findReset();
+        return;
+    }
 
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    findMatcher m;
+    if (findMatcherInit(&m, query) == -1){
+        while (findState.depth > 0)
+            findLevelFree(&findState.levels[--findState.depth]);
+        return;
+    }
+
+    findLevel *lvl = findSetQuery(query);
+    if (lvl->complete){
+        conf.findTotal = lvl->total;
+        findStep(lvl);
+    } else
+        findPoll();
 }
 
-/*** find ***/
+/* Ctrl-G: jumps to a line number, or to a file offset given as @offset. */
+void editorGoto(){
+    char *query = editorPrompt("Go to line or @offset: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
 
-void editorFindCallback(char *query, int key){
-    static int last_match = -1;
-    static int direction = 1;
-    
-    if (key == '\r' || key == '\x1b'){
-        last_match = -1;
-        direction = 1;
+    char *end;
+    int byOffset = query[0] == '@';
+    long long n = strtoll(byOffset ? query + 1 : query, &end, 10);
+    if (end == query + byOffset || *end != '\0'){
+        editorSetStatusMessage("Not a line or @offset: %s", query);
+        free(query);
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+    }
+    free(query);
+
+    editorUndoBreak();
+    if (byOffset){
+        conf.cY = editorOffsetRow(n, &conf.cX);
     } else {
-        last_match = -1;
-        direction = 1;
-    }
-
-    if (last_match == -1) direction = 1;
-    int curr = last_match;
-    for (int i = 0; i < conf.numRows; i++){
-        curr += direction;
-        if (curr == -1) curr = conf.numRows-1;
-        else if (curr == conf.numRows) curr = 0;
-
-        editorRow *eRow = &conf.eRow[curr];
-        char *match = strstr(eRow->render, query);
-        if (match){
-            last_match = curr;
-            conf.cY = curr;
-            conf.cX = editorRowRxToCx(eRow, match - eRow->render);
-            conf.rowOff = conf.numRows;
-            break;
-        }
+        if (n > conf.numRows) n = conf.numRows;
+        conf.cY = n > 0 ? n - 1 : 0;
+        conf.cX = 0;
     }
+    conf.rowOff = conf.cY > conf.screenRows / 2 ? conf.cY - conf.screenRows / 2 : 0;
 }
 
 void editorFind(){
@@ -449,7 +5526,8 @@ void editorFind(){
     int saved_colOff = conf.colOff;
     int save_rowOff = conf.rowOff;
     
-    char *query = editorPrompt("Search: %s (Use ARROWS/ENTER/ESC)", editorFindCallback);
+    findReset();
+    char *query = editorPrompt("Search: %s (Use ARROWS/ENTER/ESC, Ctrl-R regex)", editorFindCallback);
 
     if (query)
         free(query);
@@ -483,12 +5561,245 @@ void abFree(struct abuf *ab){
     free(ab->b);
 }
 
+/*** screen buffer ***/
+
+/* Rows, status bar and message bar are drawn into conf.frame, a grid of
+ * cells the size of the terminal. editorFlushScreen() compares it with
+ * conf.shadow, the last frame written, and only emits the spans that
+ * changed. */
+
+void screenResize(int rows, int cols){
+    free(conf.frame);
+    free(conf.shadow);
+    conf.frameRows = rows;
+    conf.frameCols = cols;
+    conf.frame = malloc(sizeof(screenCell) * rows * cols);
+    conf.shadow = malloc(sizeof(screenCell) * rows * cols);
+    conf.shadowValid = 0;
+}
+
+/* The cell value of the UTF-8 bytes s[0..len), at most 8 of them. */
+unsigned long long screenGlyph(const char *s, int len){
+    unsigned long long ch = 0;
+    for (int i = len - 1; i >= 0; i--) ch = ch << 8 | (unsigned char)s[i];
+    return ch;
+}
+
+void screenClear(){
+    for (int i = 0; i < conf.frameRows * conf.frameCols; i++){
+        conf.frame[i].ch = ' ';
+        conf.frame[i].attr = ATTR_NORMAL;
+    }
+}
+
+void screenFill(int y, int attr){
+    screenCell *cell = &conf.frame[y * conf.frameCols];
+    for (int x = 0; x < conf.frameCols; x++)
+        cell[x].attr = attr;
+}
+
+/* A wide character takes its cell and an empty one to the right. Writing
+ * cells from x0 up to x1 turns what is left of one cut in half into a
+ * space, on either side. */
+void screenSplitBefore(screenCell *cell, int x0){
+    if (x0 > 0 && x0 < conf.frameCols && cell[x0].ch == 0)
+        cell[x0-1].ch = ' ';
+}
+
+void screenSplitAfter(screenCell *cell, int x1){
+    if (x1 < conf.frameCols && cell[x1].ch == 0)
+        cell[x1].ch = ' ';
+}
+
+/* Puts the character s[0..len) of the given width at x and returns the
+ * column after it. A zero width character joins the cell before it if
+ * there is room, and a wide one that does not fit shows as a space. */
+int screenPutChar(int y, int x, const char *s, int len, int width, int attr){
+    if (y < 0 || y >= conf.frameRows || x < 0 || x > conf.frameCols) return x;
+    screenCell *cell = &conf.frame[y * conf.frameCols];
+
+    if (width == 0){
+        if (x == 0) return x;
+        int used = 0;
+        while (used < 8 && cell[x-1].ch >> (8 * used)) used++;
+        if (used + len <= 8) cell[x-1].ch |= screenGlyph(s, len) << (8 * used);
+        return x;
+    }
+    if (x == conf.frameCols) return x;
+    if (width == 2 && x + 1 == conf.frameCols){
+        s = " ";
+        len = width = 1;
+    }
+
+    screenSplitBefore(cell, x);
+    cell[x].ch = screenGlyph(s, len);
+    cell[x].attr = attr;
+    if (width == 2){
+        cell[x+1].ch = 0;
+        cell[x+1].attr = attr;
+    }
+    screenSplitAfter(cell, x + width);
+    return x + width;
+}
+
+/* Puts len bytes of UTF-8 at x, without expanding tabs, and returns the
+ * column after them. */
+int screenPut(int y, int x, const char *s, int len, int attr){
+    if (y < 0 || y >= conf.frameRows || x < 0) return x;
+
+    screenCell *cell = &conf.frame[y * conf.frameCols];
+    screenSplitBefore(cell, x);
+    for (int j = 0; j < len && x < conf.frameCols;){
+        if ((unsigned char)s[j] < 0x80){
+            cell[x].ch = (unsigned char)s[j++];
+            cell[x++].attr = attr;
+            continue;
+        }
+        int width;
+        int n = utf8Char(&s[j], len - j, &width);
+        x = screenPutChar(y, x, n == 1 ? "?" : &s[j], n, width, attr);
+        j += n;
+    }
+    screenSplitAfter(cell, x);
+
+    return x;
+}
+
+void screenPutHl(int y, int x, const char *s, const unsigned char *attrs, int len){
+    if (y < 0 || y >= conf.frameRows || x < 0) return;
+    if (len > conf.frameCols - x) len = conf.frameCols - x;
+
+    screenCell *cell = &conf.frame[y * conf.frameCols + x];
+    for (int j = 0; j < len; j++){
+        cell[j].ch = (unsigned char)s[j];
+        cell[j].attr = attrs[j];
+    }
+}
+
+int screenCellEq(screenCell *a, screenCell *b){
+    return a->ch == b->ch && a->attr == b->attr;
+}
+
+const char *screenAttrSeq[] = {
+    [ATTR_NORMAL] = "\x1b[m",
+    [ATTR_INVERSE] = "\x1b[7m",
+    [ATTR_COMMENT] = "\x1b[0;36m",
+    [ATTR_KEYWORD1] = "\x1b[0;33m",
+    [ATTR_KEYWORD2] = "\x1b[0;32m",
+    [ATTR_STRING] = "\x1b[0;35m",
+    [ATTR_NUMBER] = "\x1b[0;31m",
+    [ATTR_ERROR] = "\x1b[0;1;31m",
+    [ATTR_WARNING] = "\x1b[0;1;33m",
+};
+
+/* Gaps of unchanged cells shorter than this are resent rather than paying
+ * for another cursor move. */
+#define SCREEN_SPAN_GAP 8
+
+void screenEmitSpan(struct abuf *ab, int y, int x0, int x1, int *attr){
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x0 + 1);
+    abAppend(ab, buf, len);
+
+    screenCell *cell = &conf.frame[y * conf.frameCols];
+
+    int blankTail = x1 == conf.frameCols;
+    int end = x1;
+    if (blankTail){
+        while (end > x0 && cell[end-1].ch == ' ' && cell[end-1].attr == ATTR_NORMAL)
+            end--;
+        if (end == x1) blankTail = 0;
+    }
+
+    int x = x0;
+    while (x < end){
+        if (cell[x].attr != *attr){
+            *attr = cell[x].attr;
+            const char *seq = screenAttrSeq[*attr];
+            abAppend(ab, seq, strlen(seq));
+        }
+
+        char run[256];
+        int n = 0;
+        while (x < end && cell[x].attr == *attr && n <= (int)sizeof(run) - 8){
+            for (unsigned long long ch = cell[x++].ch; ch; ch >>= 8)
+                run[n++] = ch & 0xff;
+        }
+        abAppend(ab, run, n);
+    }
+
+    if (blankTail){
+        if (*attr != ATTR_NORMAL){
+            *attr = ATTR_NORMAL;
+            abAppend(ab, "\x1b[m", 3);
+        }
+        abAppend(ab, "\x1b[K", 3);
+    }
+}
+
+void editorFlushScreen(struct abuf *ab, int cy, int cx){
+    int attr = ATTR_NORMAL;
+    int changed = 0;
+
+    if (!conf.shadowValid){
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        for (int i = 0; i < conf.frameRows * conf.frameCols; i++){
+            conf.shadow[i].ch = ' ';
+            conf.shadow[i].attr = ATTR_NORMAL;
+        }
+        conf.shadowValid = 1;
+        changed = 1;
+    }
+
+    for (int y = 0; y < conf.frameRows; y++){
+        screenCell *cur = &conf.frame[y * conf.frameCols];
+        screenCell *old = &conf.shadow[y * conf.frameCols];
+
+        int x = 0;
+        while (x < conf.frameCols){
+            while (x < conf.frameCols && screenCellEq(&cur[x], &old[x])) x++;
+            if (x == conf.frameCols) break;
+
+            int start = x, end = x, same = 0;
+            while (x < conf.frameCols && same < SCREEN_SPAN_GAP){
+                if (screenCellEq(&cur[x], &old[x])) same++;
+                else {
+                    same = 0;
+                    end = x + 1;
+                }
+                x++;
+            }
+            if (end < conf.frameCols && x == conf.frameCols && same < SCREEN_SPAN_GAP)
+                end = conf.frameCols;
+
+            if (!changed) abAppend(ab, "\x1b[?25l", 6);
+            changed = 1;
+            screenEmitSpan(ab, y, start, end, &attr);
+        }
+    }
+
+    if (attr != ATTR_NORMAL) abAppend(ab, "\x1b[m", 3);
+
+    if (changed || cy != conf.shadowCY || cx != conf.shadowCX){
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+        abAppend(ab, buf, len);
+        if (changed) abAppend(ab, "\x1b[?25h", 6);
+    }
+
+    screenCell *tmp = conf.shadow;
+    conf.shadow = conf.frame;
+    conf.frame = tmp;
+    conf.shadowCY = cy;
+    conf.shadowCX = cx;
+}
+
 /*** output ***/
 
 void editorScroll(){
     conf.rX = 0;
     if (conf.cY < conf.numRows)
-        conf.rX = editorRowCxToRx(&conf.eRow[conf.cY], conf.cX);
+        conf.rX = editorRowCxToRx(editorRowAt(conf.cY), conf.cX);
 
     if (conf.cY < conf.rowOff)
         conf.rowOff = conf.cY;
@@ -503,11 +5814,48 @@ void editorScroll(){
         conf.colOff = conf.rX - conf.screenCols + 1;
 }
 
-void editorDrawRows(struct abuf *ab){
+/* Rows that are long or have multi-byte characters are drawn straight
+ * from the text, with hl giving a color per byte if not NULL, working out
+ * only the columns on screen. A character cut by the left edge shows as
+ * spaces. */
+void editorDrawText(int y, editorRow *eRow, unsigned char *hl){
+    int cx = editorRowRxToCx(eRow, conf.colOff);
+    int rx = editorRowCxToRx(eRow, cx);
+    int x = 0;
+
+    while (cx < eRow->tSize){
+        const char *c = &eRow->text[cx];
+        int attr = hl ? hl[cx] : ATTR_NORMAL;
+        int len = 1, width = 1, spaces = 0;
+        if (*c == '\t'){
+            width = KILO_TAB_STOP - rx % KILO_TAB_STOP;
+            spaces = 1;
+        } else if ((unsigned char)*c >= 0x80){
+            len = utf8Char(c, eRow->tSize - cx, &width);
+            if (len == 1) c = "?";
+        }
+        if (x == conf.screenCols && width) break;
+
+        if (rx < conf.colOff) spaces = 1;
+        if (!spaces)
+            x = screenPutChar(y, x, c, len, width, attr);
+        else
+            for (int col = rx > conf.colOff ? rx : conf.colOff; col < rx + width; col++)
+                x = screenPutChar(y, x, " ", 1, 1, attr);
+        if (rx + width > conf.colOff + conf.screenCols) break;
+        rx += width;
+        cx += len;
+    }
+}
+
+void editorDrawRows(){
+    editorHlUpdate(conf.rowOff + conf.screenRows);
+
     int y;
     for (y = 0; y < conf.screenRows; y++){
         int fileRow = y + conf.rowOff;
         if (fileRow >= conf.numRows){
+            screenPut(y, 0, "~", 1, ATTR_NORMAL);
             if(conf.numRows == 0 && y == conf.screenRows / 3){
                 char welcome[80];
                 int welcomeLen = snprintf(welcome, sizeof(welcome),
@@ -515,84 +5863,177 @@ void editorDrawRows(struct abuf *ab){
                 if (welcomeLen > conf.screenCols) welcomeLen = conf.screenCols;
 
                 int padding = ((conf.screenCols - welcomeLen) / 2);
-                if (padding){
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
-
-                abAppend(ab, welcome, welcomeLen);
+                screenPut(y, padding, welcome, welcomeLen, ATTR_NORMAL);
             }
-            else
-                abAppend(ab, "~", 1);
 
         } else {
-            int len = conf.eRow[fileRow].rSize - conf.colOff;
+            editorRow *eRow = editorRowAt(fileRow);
+            if (eRow->tSize > KILO_LONG_LINE){
+                editorDrawText(y, eRow, NULL);
+                continue;
+            }
+            char *render = editorRowRender(eRow);
+            if (eRow->utf8){
+                editorDrawText(y, eRow, conf.syntax ? editorHlText(fileRow) : NULL);
+                continue;
+            }
+            int len = eRow->rSize - conf.colOff;
             if (len < 0) len = 0;
             if (len > conf.screenCols) len = conf.screenCols;
-            abAppend(ab, &conf.eRow[fileRow].render[conf.colOff], len);
+            if (conf.syntax)
+                screenPutHl(y, 0, &render[conf.colOff], &editorHlRender(fileRow)[conf.colOff], len);
+            else
+                screenPut(y, 0, &render[conf.colOff], len, ATTR_NORMAL);
         }
-
-        abAppend(ab, "\x1b[K", 3);
-
-        abAppend(ab, "\r\n", 2); 
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab){
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar(){
+    int y = conf.screenRows;
+    screenFill(y, ATTR_INVERSE);
 
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                         conf.filename ? conf.filename: "[No name]", conf.numRows,
                         conf.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", conf.cY + 1, conf.numRows);
+    int rlen;
+    if (conf.findError)
+        rlen = snprintf(rstatus, sizeof(rstatus), "regex: %s", conf.findError);
+    else if (conf.findBusy)
+        rlen = snprintf(rstatus, sizeof(rstatus), "searching: %lld matches", conf.findTotal);
+    else if (conf.findTotal)
+        rlen = snprintf(rstatus, sizeof(rstatus), "match %lld of %lld",
+                        conf.findIndex, conf.findTotal);
+    else if (conf.saveJob){
+        int rows = __atomic_load_n(&conf.saveJob->rowsToWrite, __ATOMIC_RELAXED);
+        rlen = snprintf(rstatus, sizeof(rstatus), "saving %lld%%",
+                        __atomic_load_n(&conf.saveJob->rowsDone, __ATOMIC_RELAXED) * 100LL / (rows ? rows : 1));
+    } else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | @%lld %d/%d",
+                        conf.syntax ? conf.syntax->fileType : "no ft",
+                        editorStatusOffset() + conf.cX, conf.cY + 1, conf.numRows);
     if (len > conf.screenCols) len = conf.screenCols;
-    abAppend(ab, status, len);
-
-    while (len < conf.screenCols){
-        if (conf.screenCols - len == rlen){
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
-    }
+    screenPut(y, 0, status, len, ATTR_INVERSE);
 
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    if (conf.screenCols - len >= rlen)
+        screenPut(y, conf.screenCols - rlen, rstatus, rlen, ATTR_INVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *ab){\
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(){
   int msglen = strlen(conf.statusmsg);
   if (msglen > conf.screenCols) msglen = conf.screenCols;
-  if (msglen && time(NULL) - conf.statusmsgTime < 5)
-    abAppend(ab, conf.statusmsg, msglen);
+  if (msglen && time(NULL) - conf.statusmsgTime < KILO_MESSAGE_TIMEOUT)
+    screenPut(conf.screenRows + 1, 0, conf.statusmsg, msglen, ATTR_NORMAL);
+}
+
+/* The Ctrl-P overlay in the top right corner: where the last frame's time
+ * went, how often each probe fired, the row buffer allocations and the
+ * bytes the last frame sent to the terminal. */
+void editorDrawPerf(){
+    int width = 27;
+    int x = conf.screenCols - width;
+    if (x < 0 || conf.screenRows < PERF_PROBES + 2) return;
+
+    char line[64];
+    for (int p = 0; p < PERF_PROBES; p++){
+        int len = snprintf(line, sizeof(line), " %-6s %8.3f ms %6lld ", perfNames[p],
+                           perf.last[p] / 1e6, perf.lastCount[p]);
+        screenPut(p, x, line, len, ATTR_INVERSE);
+    }
+    int len = snprintf(line, sizeof(line), " allocs %6lld frees %5lld ",
+                       perf.lastAllocs, perf.lastFrees);
+    screenPut(PERF_PROBES, x, line, len, ATTR_INVERSE);
+    len = snprintf(line, sizeof(line), " frame bytes %13d ", conf.frameBytes);
+    screenPut(PERF_PROBES + 1, x, line, len, ATTR_INVERSE);
+}
+
+void editorResize(){
+    int rows, cols;
+    if (bench.on || getWindowSize(&rows, &cols) == -1) return;
+
+    screenResize(rows, cols);
+    conf.screenRows = rows - 2;
+    conf.screenCols = cols;
 }
 
 void editorRefreshScreen(){
+    if (perf.keyStart){
+        perfEnd(PERF_KEY, perf.keyStart);
+        perf.keyStart = 0;
+    }
+    long long frameStart = perfBegin();
+
     editorScroll();
     
     struct abuf ab = ABUF_INIT;
-    
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    screenClear();
+    long long start = perfBegin();
+    editorDrawRows();
+    perfEnd(PERF_DRAW, start);
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+    if (perf.overlay) editorDrawPerf();
+
+    start = perfBegin();
+    editorFlushScreen(&ab, conf.cY - conf.rowOff, conf.rX - conf.colOff);
+    perfEnd(PERF_FLUSH, start);
+
+    conf.frameBytes = ab.len;
+    if (bench.on){
+        bench.frames++;
+        bench.frameBytes += ab.len;
+    }
+    start = perfBegin();
+    if (ab.len) write(conf.outFd, ab.b, ab.len);
+    perfEnd(PERF_WRITE, start);
+    abFree(&ab);
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (conf.cY - conf.rowOff) + 1,
-                                              (conf.rX - conf.colOff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    perfEnd(PERF_FRAME, frameStart);
+    if (perf.on){
+        perfFrameEnd();
+        perf.lastAllocs = slab.allocs - perf.allocs;
+        perf.lastFrees = slab.frees - perf.frees;
+        perf.allocs = slab.allocs;
+        perf.frees = slab.frees;
+    }
+}
 
-    abAppend(&ab, "\x1b[?25h", 6);
+/* Paints a frame, or holds it back to stay under the frame rate. Keys that
+ * come in faster than that, queued up or not, are all handled before the
+ * next frame goes out, and a timer makes sure a held back frame still does
+ * once input stops. */
+void editorFrame(){
+    /* Keys like PAGE_DOWN work from the scroll position, so it is kept up
+     * to date for frames that are held back too. */
+    editorScroll();
+    editorMemTrim(1);
+    if (conf.followDeferred && !conf.findBusy) editorFollowPoll();
+    editorSaveSettleDeferred();
+
+    double now = editorNowMs();
+    double due = conf.lastFrame + conf.frameInterval;
+
+    if (now < due){
+        long long ns = (due - now) * 1e6 + 1;
+        struct itimerspec its = {{0, 0}, {ns / 1000000000, ns % 1000000000}};
+        timerfd_settime(conf.frameTimerFd, 0, &its, NULL);
+        conf.framePending = 1;
+        return;
+    }
+    /* A backlog longer than a frame is drained before the frame goes out,
+     * the next key calls in here again. A replay always has its next key
+     * waiting, and without a frame rate every key is painted. */
+    if (conf.frameInterval > 0 && !bench.on && inputPending()){
+        conf.framePending = 1;
+        return;
+    }
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    struct itimerspec off = {{0, 0}, {0, 0}};
+    timerfd_settime(conf.frameTimerFd, 0, &off, NULL);
+    conf.framePending = 0;
+    editorRefreshScreen();
+    conf.lastFrame = editorNowMs();
 }
 
 void editorSetStatusMessage(const char *fmt, ...){
@@ -601,6 +6042,10 @@ void editorSetStatusMessage(const char *fmt, ...){
     vsnprintf(conf.statusmsg, sizeof(conf.statusmsg), fmt, ap);
     va_end(ap);
     conf.statusmsgTime = time(NULL);
+
+    /* Wake up to take the message down again. */
+    struct itimerspec its = {{0, 0}, {KILO_MESSAGE_TIMEOUT, 0}};
+    timerfd_settime(conf.timerFd, 0, &its, NULL);
 }
 
 /*** input ***/
@@ -614,23 +6059,37 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)){
 
     while (1){
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        editorFrame();
 
         int key = editorReadKey();
         if (key == DEL_KEY || key == CTRL_KEY('h') || key == BACKSPACE){
-            if (bufLen != 0) buf[--bufLen] = '\0';
+            bufLen = utf8Prev(buf, bufLen, bufLen);
+            buf[bufLen] = '\0';
         } else if (key == '\x1b') {
             editorSetStatusMessage("");
             if (callback) callback(buf, key);
             free(buf);
             return NULL;
+        } else if (key == PASTE_START) {
+            size_t len;
+            char *text = editorReadPaste(&len);
+            for (size_t j = 0; j < len; j++){
+                if (iscntrl((unsigned char)text[j])) continue;
+                if (bufLen == bufSize - 1) {
+                    bufSize *= 2;
+                    buf = realloc(buf, bufSize);
+                }
+                buf[bufLen++] = text[j];
+            }
+            buf[bufLen] = '\0';
+            free(text);
         } else if (key == '\r') {
             if (bufLen != 0) {
                 editorSetStatusMessage("");
                 if (callback) callback(buf, key);
                 return buf;
         }
-        } else if (!iscntrl(key) && key < 128) {
+        } else if (key < 256 && !iscntrl(key)) {
             if (bufLen == bufSize - 1) {
                 bufSize *= 2;
                 buf = realloc(buf, bufSize);
@@ -638,26 +6097,45 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)){
 
         buf[bufLen++] = key;
         buf[bufLen] = '\0';
+        } else if (key == WAKE_KEY){
+            editorSavePoll();
+            editorFollowPoll();
         }
-        
+
         if (callback) callback(buf, key);
     }
 }
 
+/* Steps the cursor one character right, onto the next row at a row's end. */
+void editorCursorRight(){
+    editorRow *row = editorRowAt(conf.cY);
+    if (row && conf.cX < row->tSize){
+        int width;
+        conf.cX += utf8Char(&row->text[conf.cX], row->tSize - conf.cX, &width);
+    }
+    else if (row && conf.cX == row->tSize){
+        conf.cY++;
+        conf.cX = 0;
+    }
+}
+
 void editorMoveCursor(int key){
-    editorRow *row = (conf.cY >= conf.numRows) ? NULL : &conf.eRow[conf.cY];
+    editorUndoBreak();
+    editorRow *row = editorRowAt(conf.cY);
     
     switch(key){
         case ARROW_UP:
             if(conf.cY != 0){
                 conf.cY--;
-                conf.cX = conf.eRow[conf.cY].rSize;
+                conf.cX = editorRowAt(conf.cY)->tSize;
             }
             break;
             
         case ARROW_LEFT:
+            if (row && conf.cX > row->tSize)
+                conf.cX = row->tSize;
             if(conf.cX != 0)
-                conf.cX--;
+                conf.cX = row ? utf8Prev(row->text, conf.cX, row->tSize) : conf.cX - 1;
             else if (conf.cY > 0)
                 conf.cY--;
             break;
@@ -665,18 +6143,15 @@ void editorMoveCursor(int key){
         case ARROW_DOWN:
             if(conf.cY < conf.numRows)
                 conf.cY++;            
+            row = editorRowAt(conf.cY);
+            if (row) conf.cX = utf8Skip(row->text, conf.cX, row->tSize);
             break;
 
         case ARROW_RIGHT:
-            if (row && conf.cX < row->tSize)
-                conf.cX++;
-            else if (row && conf.cX == row->tSize){
-                conf.cY++;
-                conf.cX = 0;
-            }
+            editorCursorRight();
             break;
 
-        row = (conf.cY >= conf.numRows ? NULL : &conf.eRow[conf.cY]);
+        row = editorRowAt(conf.cY);
         int rowLen = row ? row->tSize : 0;
         if (conf.cX > rowLen)
             conf.cX = rowLen;
@@ -694,14 +6169,17 @@ void editorProcessKeypress(){
             break;
 
         case CTRL_KEY('q'):
+            editorSaveWait();
             if(conf.dirty && quitTimes > 0){
                 editorSetStatusMessage("WARNING!!! File has unsave changes. "
                 "Press Ctrl-Q %d more time(s) to quit", quitTimes);
                 quitTimes--;
                 return;
             }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            write(conf.outFd, "\x1b[2J", 4);
+            write(conf.outFd, "\x1b[H", 3);
+            if (!bench.on) disableRawMode();
+            editorCloseStats();
             exit(0);
             break;
 
@@ -713,19 +6191,37 @@ void editorProcessKeypress(){
             editorSave();
             break;
 
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+
+        case CTRL_KEY('p'):
+            perfToggleOverlay();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
         case HOME_KEY:
+            editorUndoBreak();
             conf.cX = 0;
             break;
 
         case END_KEY:
+            editorUndoBreak();
             if (conf.cY < conf.numRows)
-                conf.cX = conf.eRow[conf.cY].tSize;
+                conf.cX = editorRowAt(conf.cY)->tSize;
             break;
 
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
-            if (key == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
+            if (key == DEL_KEY) editorCursorRight();
             editorDelChar();
             break;
 
@@ -751,8 +6247,18 @@ void editorProcessKeypress(){
             editorMoveCursor(key);
             break;
 
+        case PASTE_START:
+            editorPaste();
+            break;
+
+        case WAKE_KEY:
+            editorSavePoll();
+            editorFollowPoll();
+            break;
+
         case CTRL_KEY('l'):
         case '\x1b':
+        case PASTE_END:
             break;
 
         default:
@@ -771,26 +6277,156 @@ void initEditor(){
     conf.rX = 0;
     conf.rowOff = 0;
     conf.colOff = 0;
-    conf.eRow = NULL;
+    conf.numRows = 0;
+    conf.blocks = NULL;
+    conf.blockFen = NULL;
+    conf.byteFen = NULL;
+    conf.byteFenValid = 0;
+    conf.byteGen = 0;
+    conf.statusRow = -1;
+    conf.staleBlocks = NULL;
+    conf.numStale = 0;
+    conf.staleCap = 0;
+    conf.numBlocks = 0;
+    conf.blockCap = 0;
+    conf.map = NULL;
+    conf.mapSize = 0;
+    conf.mapLive = 0;
+    conf.renderBytes = 0;
+    conf.evictHand = 0;
     conf.dirty = 0;
     conf.filename = NULL;
+    conf.followPath = NULL;
+    conf.followFd = -1;
+    conf.followFile = -1;
+    conf.syntax = NULL;
+    conf.hlValid = 0;
+    conf.hlTail = 0;
+    conf.hlText = NULL;
+    conf.hlRender = NULL;
+    conf.hlTextCap = 0;
+    conf.hlRenderCap = 0;
     conf.statusmsg[0] = '\0';
     conf.statusmsgTime = 0;
+    conf.frame = NULL;
+    conf.shadow = NULL;
+    conf.frameBytes = 0;
+    conf.inHead = 0;
+    conf.inLen = 0;
+    conf.inEof = 0;
+    conf.saveJob = NULL;
+    conf.settleJob = NULL;
+    conf.saveAgain = 0;
+    conf.saveEpoch = 0;
+    conf.grave = NULL;
+    conf.numGrave = 0;
+    conf.graveCap = 0;
+    conf.findTotal = 0;
+    conf.findBusy = 0;
+    conf.findRegex = 0;
+    conf.findError = NULL;
+    findInit();
+    journalInit();
+
+    if (pipe2(conf.wakeFd, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe");
+
+    /* SIGWINCH, SIGHUP and SIGTERM are blocked before any thread starts,
+     * so all of them inherit the mask and the signals only ever show up on
+     * conf.sigFd. */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) die("sigprocmask");
+    conf.sigFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    conf.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    conf.frameTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    conf.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (conf.sigFd == -1 || conf.timerFd == -1 || conf.frameTimerFd == -1 || conf.epollFd == -1)
+        die("event loop");
+
+    if (!bench.on) editorWatch(STDIN_FILENO, EV_INPUT);
+    editorWatch(conf.wakeFd[0], EV_WAKE);
+    editorWatch(conf.sigFd, EV_SIGNAL);
+    editorWatch(conf.timerFd, EV_TIMER);
+    editorWatch(conf.frameTimerFd, EV_TIMER);
+
+    char *fps = getenv("KILO_FPS");
+    int rate = fps ? atoi(fps) : KILO_FPS;
+    conf.frameInterval = rate > 0 ? 1000.0 / rate : 0;
+    conf.lastFrame = 0;
+    conf.framePending = 0;
     
-    if (getWindowSize(&conf.screenRows, &conf.screenCols) == -1) die("getWindowSize");
+    conf.inFd = STDIN_FILENO;
+    conf.outFd = STDOUT_FILENO;
+    if (bench.on){
+        conf.screenRows = 24;
+        conf.screenCols = 80;
+    } else if (getWindowSize(&conf.screenRows, &conf.screenCols) == -1) die("getWindowSize");
+    screenResize(conf.screenRows, conf.screenCols);
     conf.screenRows -= 2;
 }
 
 int main(int argc, char *argv[]) {
-    enableRawMode();
+    int opt;
+    int follow = 0;
+    while ((opt = getopt(argc, argv, "b:fm:")) != -1){
+        switch (opt){
+            case 'f':
+                follow = 1;
+                break;
+            case 'b':
+                bench.on = 1;
+                bench.trace = optarg;
+                break;
+            case 'm':
+                if ((mem.limit = memParseSize(optarg)) == 0){
+                    fprintf(stderr, "kilo: bad memory limit '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: kilo [-f] [-m size] [-b trace] [file | -]\n");
+                exit(1);
+        }
+    }
+
+    /* "-" reads the file from stdin, and the keys from the terminal. */
+    FILE *in = NULL;
+    if (optind < argc && strcmp(argv[optind], "-") == 0){
+        int fd = dup(STDIN_FILENO);
+        int tty = bench.on ? STDIN_FILENO : open("/dev/tty", O_RDWR);
+        if (follow || fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1 || (in = fdopen(fd, "r")) == NULL){
+            fprintf(stderr, "kilo: can't read the file from stdin\n");
+            exit(1);
+        }
+        if (tty != STDIN_FILENO) close(tty);
+    }
+
+    if (!bench.on) enableRawMode();
+    perfInit();
     initEditor();
-    if (argc >= 2)
-        editorOpen(argv[1]);
+    if (in){
+        double start = editorNowMs();
+        editorLoad(in);
+        fclose(in);
+        conf.openMs = editorNowMs() - start;
+    } else if (optind < argc){
+        double start = editorNowMs();
+        if (follow)
+            editorFollowStart(argv[optind]);
+        else
+            editorOpen(argv[optind]);
+        conf.openMs = editorNowMs() - start;
+    }
+    if (bench.on) benchStart();
     
-    editorSetStatusMessage("HELP: Ctrl-Q = save | Ctrl-F = find | Ctrl-Q = quit");
+    editorSetStatusMessage("HELP: Ctrl-Q = save | Ctrl-F = find | Ctrl-G = goto | Ctrl-Z/Ctrl-Y = undo/redo | Ctrl-Q = quit");
+    if (conf.filename && !follow) editorJournalOpen();
 
     while (1){
-        editorRefreshScreen();
+        editorFrame();
         editorProcessKeypress();
     };
 